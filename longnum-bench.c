@@ -0,0 +1,533 @@
+// Checks longnum.c against the computer's own 128-bit arithmetic, and times
+// it against the byte-at-a-time routines it replaced (kept below, as they
+// were). Run with "make bench".
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "longnum.h"
+
+typedef unsigned __int128 u128;
+
+// The old routines: big-endian byte arrays, multiplying by shifting and
+// adding a bit at a time and dividing by shifting and subtracting a bit at
+// a time. old_longshr() still has its stray break, so it only ever shifts by
+// one byte however many it's asked for.
+
+static uint8_t old_longzero(uint8_t num[], uint8_t len)
+{
+    uint8_t i;
+    for (i = 0; i < len; i++)
+    {
+        if (num[i] > 0)
+            return 0;
+    }
+    return 1;
+}
+
+static void old_longshl(uint8_t num[], uint8_t len, uint8_t bits)
+{
+    uint8_t i;
+    uint8_t temp;
+
+    while (bits > 0)
+    {
+        if (bits < 8)
+        {
+            num[0] <<= bits;
+            for (i = 1; i < len; i++)
+            {
+                temp = num[i] >> (8 - bits);
+                num[i] <<= bits;
+                num[i - 1] |= temp;
+            }
+            bits = 0;
+        }
+        else
+        {
+            for (i = 0; i < len - 1; i++)
+                num[i] = num[i + 1];
+            num[i] = 0;
+            bits -= 8;
+        }
+    }
+}
+
+static void old_longshr(uint8_t num[], uint8_t len, uint8_t bits)
+{
+    int8_t i;
+    uint8_t temp;
+
+    while (bits > 0)
+    {
+        if (bits < 8)
+        {
+            num[len - 1] >>= bits;
+            for (i = len - 2; i >= 0; i--)
+            {
+                temp = num[i] << (8 - bits);
+                num[i] >>= bits;
+                num[i + 1] |= temp;
+            }
+            bits = 0;
+        }
+        else
+        {
+            for (i = len - 1; i > 0; i--)
+                num[i] = num[i - 1];
+            num[0] = 0;
+            bits -= 8;
+            break;
+        }
+    }
+}
+
+static int8_t old_longcmp(uint8_t d1[], uint8_t d2[], uint8_t len)
+{
+    uint8_t i;
+    for (i = 0; i < len; i++)
+    {
+        if (d1[i] > d2[i])
+            return 1;
+        else if (d1[i] < d2[i])
+            return -1;
+    }
+    return 0;
+}
+
+static void old_longadd(uint8_t d1[], uint8_t len1, uint8_t d2[], uint8_t len2)
+{
+    int8_t i;
+    uint16_t temp;
+    uint8_t carry = 0;
+
+    for (i = 0; i < len1; i++)
+    {
+        temp = d1[len1 - i - 1];
+        temp += carry;
+        if (i < len2)
+            temp += d2[len2 - i - 1];
+        d1[len1 - i - 1] = temp & 0xff;
+        carry = temp >> 8;
+    }
+}
+
+static void old_longsub(uint8_t d1[], uint8_t d2[], uint8_t len)
+{
+    int8_t i;
+    uint8_t borrow = 0;
+
+    for (i = len - 1; i >= 0; i--)
+    {
+        if (d1[i] >= borrow)
+        {
+            d1[i] -= borrow;
+            borrow = 0;
+        }
+        else
+        {
+            d1[i] -= borrow;
+            borrow = 1;
+        }
+        borrow += d1[i] >= d2[i] ? 0 : 1;
+        d1[i] -= d2[i];
+    }
+}
+
+static void old_setbit(uint8_t num[], uint8_t len, uint8_t bit)
+{
+    uint8_t byte = len - 1 - (bit / 8);
+    bit = bit % 8;
+    if (byte < len)
+        num[byte] |= (1 << bit);
+}
+
+static void old_longdiv(uint8_t d1[], uint8_t len1, uint8_t d2[], uint8_t len2,
+    uint8_t result[], uint8_t remainder[], uint8_t work[])
+{
+    int8_t magnitude;
+
+    memcpy(work + (len1 - len2), d2, len2);
+    memset(work, 0, len1 - len2);
+    if (old_longzero(d2, len2))
+    {
+        memset(result, 0xff, len1);
+        memset(remainder, 0, len1);
+        return;
+    }
+    for (magnitude = 0; (work[0] & 0x80) == 0; magnitude++)
+        old_longshl(work, len1, 1);
+    memcpy(remainder, d1, len1);
+    memset(result, 0, len1);
+    while (magnitude >= 0)
+    {
+        if (old_longcmp(remainder, work, len1) >= 0)
+        {
+            old_longsub(remainder, work, len1);
+            old_setbit(result, len1, magnitude);
+        }
+        old_longshr(work, len1, 1);
+        magnitude--;
+    }
+}
+
+static void old_longmult(uint8_t d1[], uint8_t len1, uint8_t d2[], uint8_t len2,
+    uint8_t result[], uint8_t work[])
+{
+    uint8_t i;
+    int j;
+    uint8_t worklen = len1 + len2;
+
+    memcpy(work + len2, d1, len1);
+    memset(work, 0, len2);
+    memset(result, 0, worklen);
+    for (i = 0; i < (len2 * 8); i++)
+    {
+        j = len2 - (i / 8) - 1;
+        if (d2[j] & (1 << (i % 8)))
+            old_longadd(result, worklen, work, worklen);
+        old_longshl(work, worklen, 1);
+    }
+}
+
+// Conversions, both ways
+
+static void to_limbs(limb_t num[], uint8_t len, u128 value)
+{
+    uint8_t i;
+    for (i = 0; i < len; i++, value >>= 16)
+        num[i] = value;
+}
+
+static u128 from_limbs(const limb_t num[], uint8_t len)
+{
+    u128 value = 0;
+    while (len-- > 0)
+        value = value << 16 | num[len];
+    return value;
+}
+
+static void to_bytes(uint8_t num[], uint8_t len, u128 value)
+{
+    while (len-- > 0)
+    {
+        num[len] = value;
+        value >>= 8;
+    }
+}
+
+static u128 from_bytes(const uint8_t num[], uint8_t len)
+{
+    u128 value = 0;
+    uint8_t i;
+    for (i = 0; i < len; i++)
+        value = value << 8 | num[i];
+    return value;
+}
+
+static uint64_t seed = 88172645463325252ULL;
+
+static uint64_t next_random()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+// Random numbers of bits bits, biased towards the awkward cases: limbs of
+// all ones or all zeros, and just the top bit set
+static u128 random_bits(int bits)
+{
+    u128 value = (u128)next_random() << 64 | next_random();
+    switch (next_random() % 8)
+    {
+        case 0:
+            value = ~(u128)0;
+            break;
+        case 1:
+            value &= ~(u128)0xffff << (next_random() % 8 * 16);
+            break;
+        case 2:
+            value = (u128)1 << (bits - 1);
+            break;
+    }
+    if (bits < 128)
+        value &= ((u128)1 << bits) - 1;
+    return value;
+}
+
+static void print128(const char *name, u128 value)
+{
+    printf(" %s=%016llx%016llx", name, (unsigned long long)(value >> 64),
+        (unsigned long long)value);
+}
+
+static int failures;
+
+static void check(const char *what, u128 got, u128 want, u128 a, u128 b)
+{
+    if (got == want)
+        return;
+    if (failures++ < 10)
+    {
+        printf("%s:", what);
+        print128("a", a);
+        print128("b", b);
+        print128("got", got);
+        print128("want", want);
+        printf("\n");
+    }
+}
+
+#define CHECKS 1000000
+
+static void check_all()
+{
+    limb_t x[8], y[8], z[8], r[8], work[17];
+    uint8_t bx[16], by[16], bz[16], br[16], bwork[16];
+    int i;
+
+    for (i = 0; i < CHECKS; i++)
+    {
+        int len1 = 1 + next_random() % 4, len2 = 1 + next_random() % 4;
+        u128 a = random_bits(len1 * 16), b = random_bits(len2 * 16);
+        uint16_t bits = next_random() % 140;
+
+        // Multiply: up to 64 by 64 bits
+        to_limbs(x, len1, a);
+        to_limbs(y, len2, b);
+        longmult(x, len1, y, len2, z);
+        check("longmult", from_limbs(z, len1 + len2), a * b, a, b);
+
+        // Divide: up to 128 by 64 bits
+        a = random_bits(len1 * 32);
+        to_limbs(x, len1 * 2, a);
+        longdiv(x, len1 * 2, y, len2, z, r, work);
+        if (b)
+        {
+            check("longdiv quotient", from_limbs(z, len1 * 2), a / b, a, b);
+            check("longdiv remainder", from_limbs(r, len2), a % b, a, b);
+        }
+        else
+            check("longdiv by zero", from_limbs(z, len1 * 2),
+                len1 == 4 ? ~(u128)0 : ((u128)1 << (len1 * 32)) - 1, a, b);
+
+        // Shift, carry and borrow, 128 bits
+        b = random_bits(128);
+        to_limbs(x, 8, a);
+        longshl(x, 8, bits);
+        check("longshl", from_limbs(x, 8), bits < 128 ? a << bits : 0, a, bits);
+        to_limbs(x, 8, a);
+        longshr(x, 8, bits);
+        check("longshr", from_limbs(x, 8), bits < 128 ? a >> bits : 0, a, bits);
+        to_limbs(x, 8, a);
+        to_limbs(y, 8, b);
+        check("longadd carry", longadd(x, 8, y, 8), a + b < a, a, b);
+        check("longadd", from_limbs(x, 8), a + b, a, b);
+        to_limbs(x, 8, a);
+        check("longsub borrow", longsub(x, y, 8), a < b, a, b);
+        check("longsub", from_limbs(x, 8), a - b, a, b);
+        to_limbs(x, 8, a);
+        check("longcmp", longcmp(x, y, 8), a > b ? 1 : a < b ? -1 : 0, a, b);
+
+        // As the firmware uses it: 32 by 32 bits over 32, when it fits
+        uint32_t p = next_random(), q = next_random() >> (next_random() % 32);
+        uint32_t d = next_random() >> (next_random() % 32), rem;
+        if (d && (uint64_t)p * q / d <= 0xffffffff)
+        {
+            check("longmuldiv", longmuldiv(p, q, d, &rem), (uint64_t)p * q / d, p, q);
+            check("longmuldiv remainder", rem, (uint64_t)p * q % d, p, q);
+        }
+    }
+
+    // The old ones, for what they're worth: a 32 by 32 bit multiply and 64
+    // by 32 bit divide get the right answers, but shifts of more than 8
+    // bits to the right don't
+    int old_failures = failures;
+    for (i = 0; i < CHECKS / 100; i++)
+    {
+        u128 a = random_bits(32), b = random_bits(32);
+        to_bytes(bx, 4, a);
+        to_bytes(by, 4, b);
+        old_longmult(bx, 4, by, 4, br, bwork);
+        check("old longmult", from_bytes(br, 8), a * b, a, b);
+
+        a = random_bits(64);
+        to_bytes(bx, 8, a);
+        to_bytes(by, 8, b);
+        if (b)
+        {
+            old_longdiv(bx, 8, by + 4, 4, bz, br, bwork);
+            check("old longdiv", from_bytes(bz, 8), a / b, a, b);
+        }
+    }
+    to_bytes(bx, 8, 0x123456789abcdef0ULL);
+    old_longshr(bx, 8, 16);
+    printf("The old longshr() shifts 123456789abcdef0 right 16 bits to %016llx, "
+        "not 0000123456789abc\n", (unsigned long long)from_bytes(bx, 8));
+    if (failures == old_failures)
+        printf("The old multiply and divide agree.\n");
+    else
+        printf("The old multiply or divide gave %d wrong answers.\n", failures - old_failures);
+    failures = old_failures;
+}
+
+// Timing: each operation on the same random numbers, many times over
+
+#define OPERANDS 1024
+#define ROUNDS 200
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static uint32_t operand_a[OPERANDS], operand_b[OPERANDS], operand_c[OPERANDS];
+static volatile uint32_t sink;
+
+static void report(const char *what, double old_time, double new_time)
+{
+    double per = 1e9 / ((double)ROUNDS * OPERANDS);
+    printf("%-32s %9.1f ns %9.1f ns %7.1fx\n", what, old_time * per, new_time * per,
+        old_time / new_time);
+}
+
+static void time_all()
+{
+    limb_t x[4], y[4], z[8], r[4], work[9];
+    uint8_t bx[8], by[8], bz[16], br[16], bwork[16];
+    double start, old_time, new_time;
+    int i, round;
+
+    for (i = 0; i < OPERANDS; i++)
+    {
+        operand_a[i] = next_random();
+        operand_b[i] = next_random();
+        operand_c[i] = next_random() | 1;
+    }
+    printf("%-32s %12s %12s %8s\n", "", "old", "new", "");
+
+    // 32 by 32 bits
+    start = now();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < OPERANDS; i++)
+        {
+            to_bytes(bx, 4, operand_a[i]);
+            to_bytes(by, 4, operand_b[i]);
+            old_longmult(bx, 4, by, 4, bz, bwork);
+            sink += bz[7];
+        }
+    }
+    old_time = now() - start;
+    start = now();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < OPERANDS; i++)
+        {
+            longset(x, 2, operand_a[i]);
+            longset(y, 2, operand_b[i]);
+            longmult(x, 2, y, 2, z);
+            sink += z[0];
+        }
+    }
+    new_time = now() - start;
+    report("multiply 32 x 32 bits", old_time, new_time);
+
+    // 64 by 32 bits
+    start = now();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < OPERANDS; i++)
+        {
+            to_bytes(bx, 8, (uint64_t)operand_a[i] << 32 | operand_b[i]);
+            to_bytes(by, 4, operand_c[i]);
+            old_longdiv(bx, 8, by, 4, bz, br, bwork);
+            sink += bz[7];
+        }
+    }
+    old_time = now() - start;
+    start = now();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < OPERANDS; i++)
+        {
+            to_limbs(x, 4, (uint64_t)operand_a[i] << 32 | operand_b[i]);
+            longset(y, 2, operand_c[i]);
+            longdiv(x, 4, y, 2, z, r, work);
+            sink += z[0];
+        }
+    }
+    new_time = now() - start;
+    report("divide 64 / 32 bits", old_time, new_time);
+
+    // What the firmware does with them: a step's pixel, from its position
+    start = now();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < OPERANDS; i++)
+        {
+            to_bytes(bx, 4, operand_a[i]);
+            to_bytes(by, 4, operand_b[i] & 0xffff);
+            old_longmult(bx, 4, by, 4, bz, bwork);
+            to_bytes(by, 4, operand_c[i]);
+            old_longdiv(bz, 8, by, 4, br, bz + 8, bwork);
+            sink += br[7];
+        }
+    }
+    old_time = now() - start;
+    start = now();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < OPERANDS; i++)
+        {
+            uint32_t rem;
+            sink += longmuldiv(operand_a[i], operand_b[i] & 0xffff, operand_c[i], &rem);
+        }
+    }
+    new_time = now() - start;
+    report("32 x 16 / 32 bits", old_time, new_time);
+
+    // By 5 bits right, which the old one can manage
+    start = now();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < OPERANDS; i++)
+        {
+            to_bytes(bx, 8, (uint64_t)operand_a[i] << 32 | operand_b[i]);
+            old_longshr(bx, 8, 5);
+            sink += bx[7];
+        }
+    }
+    old_time = now() - start;
+    start = now();
+    for (round = 0; round < ROUNDS; round++)
+    {
+        for (i = 0; i < OPERANDS; i++)
+        {
+            to_limbs(x, 4, (uint64_t)operand_a[i] << 32 | operand_b[i]);
+            longshr(x, 4, 5);
+            sink += x[0];
+        }
+    }
+    new_time = now() - start;
+    report("shift 64 bits right by 5", old_time, new_time);
+}
+
+int main()
+{
+    check_all();
+    if (failures)
+    {
+        printf("%d wrong answers.\n", failures);
+        return 1;
+    }
+    printf("%d random checks of each routine passed.\n\n", CHECKS);
+    time_all();
+    return 0;
+}
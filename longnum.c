@@ -3,7 +3,9 @@
 
 #include "longnum.h"
 
-uint8_t longzero(uint8_t num[], uint8_t len)
+#define LIMB_BITS 16
+
+uint8_t longzero(const limb_t num[], uint8_t len)
 {
 	uint8_t i;
 	for (i = 0; i < len; i++)
@@ -15,96 +17,64 @@ uint8_t longzero(uint8_t num[], uint8_t len)
 	return 1;
 }
 
-void longshl(uint8_t num[], uint8_t len, uint8_t bits)
+void longshl(limb_t num[], uint8_t len, uint16_t bits)
 {
-	uint8_t i;
-	uint8_t temp;
+	uint16_t limbs = bits / LIMB_BITS;
+	int8_t i;
 
-	while (bits > 0)
+	if (limbs >= len)
 	{
-		if (bits < 8)
-		{
-			num[0] <<= bits;
-
-			/* Shift 1 to 7 bits */
-			for (i = 1; i < len; i++)
-			{
-				/* Save shifted-out bits */
-				temp = num[i] >> (8 - bits);
-
-				/* Move bits up */
-				num[i] <<= bits;
-
-				/* Add saved bits to leftwards byte */
-				num[i - 1] |= temp;
-			}
-			
-			bits = 0;
-		}
-		else
-		{
-			/* 8 or more - shift by one byte */
-			for (i = 0; i < len - 1; i++)
-				num[i] = num[i + 1];	
+		memset(num, 0, len * sizeof(limb_t));
+		return;
+	}
 
-			num[i] = 0;
-			bits -= 8;
-		}
+	/* Whole limbs first, then what's left over, carried up from below */
+	bits %= LIMB_BITS;
+	for (i = len - 1; i >= (int8_t)limbs; i--)
+	{
+		dlimb_t temp = (dlimb_t)num[i - limbs] << bits;
+		if (bits && i > (int8_t)limbs)
+			temp |= num[i - limbs - 1] >> (LIMB_BITS - bits);
+		num[i] = temp;
 	}
+	for (; i >= 0; i--)
+		num[i] = 0;
 }
 
-void longshr(uint8_t num[], uint8_t len, uint8_t bits)
+void longshr(limb_t num[], uint8_t len, uint16_t bits)
 {
-	int8_t i;
-	uint8_t temp;
+	uint16_t limbs = bits / LIMB_BITS;
+	uint8_t i;
 
-	while (bits > 0)
+	if (limbs >= len)
 	{
-		if (bits < 8)
-		{
-			num[len - 1] >>= bits;
-
-			/* Shift 1 to 7 bits */
-			for (i = len - 2; i >= 0; i--)
-			{
-				/* Save shifted-out bits */
-				temp = num[i] << (8 - bits);
-
-				/* Move bits right */
-				num[i] >>= bits;
-
-				/* Add saved bits to rightwards byte */
-				num[i + 1] |= temp;
-			}
-			
-			bits = 0;
-		}
-		else
-		{
-			/* 8 or more - shift by one byte */
-			for (i = len - 1; i > 0; i--)
-				num[i] = num[i - 1];	
+		memset(num, 0, len * sizeof(limb_t));
+		return;
+	}
 
-			num[0] = 0;
-			bits -= 8;
-			break;
-		}
+	/* Whole limbs first, then what's left over, carried down from above */
+	bits %= LIMB_BITS;
+	for (i = 0; i < len - limbs; i++)
+	{
+		limb_t temp = num[i + limbs] >> bits;
+		if (bits && i + limbs + 1 < len)
+			temp |= (dlimb_t)num[i + limbs + 1] << (LIMB_BITS - bits);
+		num[i] = temp;
 	}
+	for (; i < len; i++)
+		num[i] = 0;
 }
 
 /* Compare two numbers with the same length (result positive if
    first number is bigger) */
-int8_t longcmp(uint8_t d1[], uint8_t d2[], uint8_t len)
+int8_t longcmp(const limb_t d1[], const limb_t d2[], uint8_t len)
 {
-	/* Size of operands in bits */
-	uint8_t i;
-
-	/* Compare byte at a time */
-	for (i = 0; i < len; i++)
+	/* Compare limb at a time, from the top */
+	while (len-- > 0)
 	{
-		if (d1[i] > d2[i])
+		if (d1[len] > d2[len])
 			return 1;
-		else if (d1[i] < d2[i])
+		else if (d1[len] < d2[len])
 			return -1;
 	}
 
@@ -112,171 +82,203 @@ int8_t longcmp(uint8_t d1[], uint8_t d2[], uint8_t len)
 	return 0;
 }
 
-/* Add two big numbers - only compares lowest (len1)bytes of both terms */
-void longadd(uint8_t d1[], uint8_t len1, uint8_t d2[], uint8_t len2)
+/* Add d2 to d1, which is at least as long. Returns the carry out of the top. */
+limb_t longadd(limb_t d1[], uint8_t len1, const limb_t d2[], uint8_t len2)
 {
-	int8_t i;
-	uint16_t temp;
-	uint8_t carry = 0;
+	uint8_t i;
+	dlimb_t carry = 0;
 
-	/* Start at the right */
 	for (i = 0; i < len1; i++)
 	{
-		temp = d1[len1 - i - 1];
-		temp += carry;
-
+		carry += d1[i];
 		if (i < len2)
-		{
-			temp += d2[len2 - i - 1];
-		}
+			carry += d2[i];
 
-		d1[len1 - i - 1] = temp & 0xff;
-		carry = temp >> 8;
+		d1[i] = carry;
+		carry >>= LIMB_BITS;
 	}
-}
 
+	return carry;
+}
 
-void longsub(uint8_t d1[], uint8_t d2[], uint8_t len)
+/* Subtract d2 from d1. Returns 1 if it went below zero. */
+limb_t longsub(limb_t d1[], const limb_t d2[], uint8_t len)
 {
-	int8_t i;
-	uint8_t borrow = 0;
+	uint8_t i;
+	limb_t borrow = 0;
 
-	/* Start at the right */
-	for (i = len - 1; i >= 0; i--)
+	for (i = 0; i < len; i++)
 	{
-		/* Previous borrow */
-		if (d1[i] >= borrow)
-		{
-			d1[i] -= borrow;
-			borrow = 0;
-		}
-		else
-		{
-			d1[i] -= borrow;
-			borrow = 1;
-		}
-
-		/* Borrow needed? */
-		borrow += d1[i] >= d2[i] ? 0 : 1;
-
-		/* Subtract */
-		d1[i] -= d2[i];
+		/* Wraps round if it borrows, leaving the top half set */
+		dlimb_t temp = (dlimb_t)d1[i] - d2[i] - borrow;
+		d1[i] = temp;
+		borrow = temp >> LIMB_BITS ? 1 : 0;
 	}
+
+	return borrow;
 }
 
-static void setbit(uint8_t num[], uint8_t len, uint8_t bit)
+void longmult(const limb_t d1[], uint8_t len1, const limb_t d2[], uint8_t len2,
+	limb_t result[])
 {
-	uint8_t byte = len - 1 - (bit / 8);
-	bit = bit % 8;
+	/* Multiply d1[] by d2[].
+	   Place result in result[], which must be len1 + len2 limbs.
+	   Schoolbook: a row of limb products for each limb of d2, added in as
+	   it goes. A limb times a limb plus two more limbs always fits in a
+	   double limb, so the carry never overflows. */
+	uint8_t i, j;
+
+	memset(result, 0, (len1 + len2) * sizeof(limb_t));
+
+	for (i = 0; i < len2; i++)
+	{
+		dlimb_t carry = 0;
 
-	if (byte < len)
-		num[byte] |= (1 << bit);
+		if (d2[i] == 0)
+			continue;
+
+		for (j = 0; j < len1; j++)
+		{
+			carry += (dlimb_t)d1[j] * d2[i] + result[i + j];
+			result[i + j] = carry;
+			carry >>= LIMB_BITS;
+		}
+		result[i + len1] = carry;
+	}
 }
 
-void longdiv(uint8_t d1[], uint8_t len1, uint8_t d2[], uint8_t len2,
-	uint8_t result[], uint8_t remainder[], uint8_t work[])
+void longdiv(const limb_t d1[], uint8_t len1, const limb_t d2[], uint8_t len2,
+	limb_t result[], limb_t remainder[], limb_t work[])
 {
 	/* Divide d1[] by d2[].
-	   Place result in result[] and remainder[].
-	   Obliterates work[] which is same size as d1[]. */
-
-	int8_t magnitude;
-
-	/* Copy divisor to working area */
-	memcpy(work + (len1 - len2), d2, len2);
-	memset(work, 0, len1 - len2);
+	   Place result in result[] (len1 limbs) and remainder[] (len2 limbs).
+	   Obliterates work[], which must be len1 + len2 + 1 limbs.
+	   Knuth's algorithm D: each limb of the result is guessed from the top
+	   two limbs of what's left over the top limb of the divisor, which is
+	   at most 2 too big once the divisor is shifted up to its top bit. */
+	limb_t *u = work, *v = work + len1 + 1;
+	uint8_t n = len2, shift = 0;
+	int8_t i, j;
+
+	/* Leading zero limbs of the divisor don't count */
+	while (n > 0 && d2[n - 1] == 0)
+		n--;
 
 	/* Test for divide by zero */
-	if (longzero(d2, len2))
+	if (n == 0)
 	{
 		/* As close to infinity as possible */
-		memset(result, 0xff, len1);
-		memset(remainder, 0, len1);
+		memset(result, 0xff, len1 * sizeof(limb_t));
+		memset(remainder, 0, len2 * sizeof(limb_t));
 		return;
 	}
-	
-	/* Move divisor up to top bit of work area */
-	for (magnitude = 0; (work[0] & 0x80) == 0; magnitude++)
-		longshl(work, len1, 1);
-
-	/* Copy dividend into remainder */
-	memcpy(remainder, d1, len1);
-
-	/* Clear result */
-	memset(result, 0, len1);
-	
-	while (magnitude >= 0)
+
+	memset(result, 0, len1 * sizeof(limb_t));
+	memset(remainder, 0, len2 * sizeof(limb_t));
+
+	/* Divisor longer than the dividend: it's all remainder */
+	if (len1 < n)
 	{
-		/* Compare remainder with divisor work area */
+		memcpy(remainder, d1, len1 * sizeof(limb_t));
+		return;
+	}
 
-		/* If possible to do so... */
-		if (longcmp(remainder, work, len1) >= 0)
+	/* Dividing by a single limb, a limb at a time from the top */
+	if (n == 1)
+	{
+		dlimb_t rem = 0;
+		for (j = len1 - 1; j >= 0; j--)
 		{
-			/* Subtract divisor from remainder */
-			longsub(remainder, work, len1);
-
-			/* Set bit in result */
-			setbit(result, len1, magnitude);
+			rem = rem << LIMB_BITS | d1[j];
+			result[j] = rem / d2[0];
+			rem %= d2[0];
 		}
-
-		longshr(work, len1, 1);
-		magnitude--;
+		remainder[0] = rem;
+		return;
 	}
-	
-}
-
-/* Multiplication algorithm as used by ancient egyptian scribes */
-void longmult(uint8_t d1[], uint8_t len1, uint8_t d2[], uint8_t len2,
-	uint8_t result[], uint8_t work[])
-{
-	/* Multiply d1[] by d2[].
-	   Place result in result[].
-	   Obliterates work[] which must be size of d1 plus d2. */
-	uint8_t i;
-	int j;
-	uint8_t worklen = len1 + len2;
 
-	/* For efficiency (fewer adds) d2 should be shorter */
+	/* Shift both up until the divisor's top bit is set */
+	while (!(d2[n - 1] << shift & 0x8000))
+		shift++;
+	memcpy(v, d2, n * sizeof(limb_t));
+	longshl(v, n, shift);
+	memcpy(u, d1, len1 * sizeof(limb_t));
+	u[len1] = 0;
+	longshl(u, len1 + 1, shift);
 
-	/* Copy d1 into work buffer */
-	memcpy(work + len2, d1, len1);
-	memset(work, 0, len2);
+	for (j = len1 - n; j >= 0; j--)
+	{
+		dlimb_t top = (dlimb_t)u[j + n] << LIMB_BITS | u[j + n - 1];
+		dlimb_t qhat = top / v[n - 1];
+		dlimb_t rhat = top % v[n - 1];
+		dlimb_t carry = 0;
+		limb_t borrow = 0;
+
+		/* The top three limbs are enough to take the guess down to at
+		   most 1 too big */
+		while (qhat > 0xffff
+			|| qhat * v[n - 2] > (rhat << LIMB_BITS | u[j + n - 2]))
+		{
+			qhat--;
+			rhat += v[n - 1];
+			if (rhat > 0xffff)
+				break;
+		}
 
-	/* Clear result (same size as worklen) */
-	memset(result, 0, worklen);
+		/* Multiply and subtract */
+		for (i = 0; i < n; i++)
+		{
+			carry += qhat * v[i];
+			dlimb_t temp = (dlimb_t)u[i + j] - (limb_t)carry - borrow;
+			u[i + j] = temp;
+			borrow = temp >> LIMB_BITS ? 1 : 0;
+			carry >>= LIMB_BITS;
+		}
+		dlimb_t temp = (dlimb_t)u[j + n] - carry - borrow;
+		u[j + n] = temp;
 
-	/* Once for each bit of d2 */
-	for (i = 0; i < (len2 * 8); i++)
-	{
-		j = len2 - (i / 8) - 1;
-		if (d2[j] & (1 << (i % 8)))
-			longadd(result, worklen, work, worklen);
-		longshl(work, worklen, 1);
+		/* Went below zero: it was 1 too big, so add one divisor back */
+		if (temp >> LIMB_BITS)
+		{
+			qhat--;
+			longadd(u + j, n + 1, v, n);
+		}
+		result[j] = qhat;
 	}
+
+	/* What's left is the remainder, shifted back down */
+	longshr(u, n + 1, shift);
+	memcpy(remainder, u, n * sizeof(limb_t));
 }
 
-void mathbuf_set(uint8_t buf[], uint8_t size, uint32_t value)
+uint32_t longmuldiv(uint32_t a, uint32_t b, uint32_t c, uint32_t *remainder)
 {
-	uint8_t i;
-	for (i = 0; i < size - 4; i++)
-		buf[i] = 0;
-	buf[size - 1] = value & 0xff;
-	buf[size - 2] = (value >> 8) & 0xff;
-	buf[size - 3] = (value >> 16) & 0xff;
-	buf[size - 4] = (value >> 24) & 0xff;
+	/* The result has to fit in 32 bits */
+	limb_t x[2], y[2], z[2], product[4], result[4], rem[2], work[7];
+
+	longset(x, 2, a);
+	longset(y, 2, b);
+	longset(z, 2, c);
+	longmult(x, 2, y, 2, product);
+	longdiv(product, 4, z, 2, result, rem, work);
+	if (remainder)
+		*remainder = longget(rem, 2);
+	return longget(result, 4);
 }
 
-uint32_t mathbuf_get(uint8_t buf[], uint8_t size)
+void longset(limb_t num[], uint8_t len, uint32_t value)
 {
-	uint32_t temp;
-	temp = buf[size - 4] & 0xff;
-	temp <<= 8;
-	temp |= buf[size - 3] & 0xff;
-	temp <<= 8;
-	temp |= buf[size - 2] & 0xff;
-	temp <<= 8;
-	temp |= buf[size - 1] & 0xff;
+	memset(num, 0, len * sizeof(limb_t));
+	num[0] = value & 0xffff;
+	if (len > 1)
+		num[1] = value >> LIMB_BITS;
+}
+
+uint32_t longget(const limb_t num[], uint8_t len)
+{
+	uint32_t temp = num[0];
+	if (len > 1)
+		temp |= (dlimb_t)num[1] << LIMB_BITS;
 
 	return temp;
 }
-
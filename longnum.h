@@ -1,23 +1,33 @@
 #ifndef __LONGNUM_H_
 #define __LONGNUM_H_
 
-uint8_t longzero(uint8_t num[], uint8_t len);
+#include <stdint.h>
 
-void longshl(uint8_t num[], uint8_t len, uint8_t bits);
-void longshr(uint8_t num[], uint8_t len, uint8_t bits);
-int8_t longcmp(uint8_t d1[], uint8_t d2[], uint8_t len);
+/* Numbers of any length, as arrays of 16-bit limbs, least significant
+   first. Lengths are in limbs. */
+typedef uint16_t limb_t;
+typedef uint32_t dlimb_t;
 
-void longadd(uint8_t d1[], uint8_t len1, uint8_t d2[], uint8_t len2);
-void longsub(uint8_t d1[], uint8_t d2[], uint8_t len);
+uint8_t longzero(const limb_t num[], uint8_t len);
 
-void longdiv(uint8_t d1[], uint8_t len1, uint8_t d2[], uint8_t len2,
-	uint8_t result[], uint8_t remainder[], uint8_t work[]);
+void longshl(limb_t num[], uint8_t len, uint16_t bits);
+void longshr(limb_t num[], uint8_t len, uint16_t bits);
+int8_t longcmp(const limb_t d1[], const limb_t d2[], uint8_t len);
 
-void longmult(uint8_t d1[], uint8_t len1, uint8_t d2[], uint8_t len2,
-	uint8_t result[], uint8_t work[]);
+limb_t longadd(limb_t d1[], uint8_t len1, const limb_t d2[], uint8_t len2);
+limb_t longsub(limb_t d1[], const limb_t d2[], uint8_t len);
 
-void mathbuf_set(uint8_t buf[], uint8_t size, uint32_t value);
-uint32_t mathbuf_get(uint8_t buf[], uint8_t size);
+void longdiv(const limb_t d1[], uint8_t len1, const limb_t d2[], uint8_t len2,
+	limb_t result[], limb_t remainder[], limb_t work[]);
+
+void longmult(const limb_t d1[], uint8_t len1, const limb_t d2[], uint8_t len2,
+	limb_t result[]);
+
+/* a * b / c without losing the top of a * b */
+uint32_t longmuldiv(uint32_t a, uint32_t b, uint32_t c, uint32_t *remainder);
+
+void longset(limb_t num[], uint8_t len, uint32_t value);
+uint32_t longget(const limb_t num[], uint8_t len);
 
 
 #endif
@@ -3,9 +3,12 @@
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
 #include <util/delay_basic.h>
+#include <util/crc16.h>
 #include <stdint.h>
 
 #include "serial.h"
+#include "longnum.h"
+#include "timer0.h"
 #include "timer1.h"
 #include "timer2.h"
 
@@ -13,19 +16,73 @@
 
 #define LOOKUP _binary_lookup_bin_start
 #define LOOKUP_END _binary_lookup_bin_end
+#define JERK _binary_jerk_bin_start
+#define JERK_END _binary_jerk_bin_end
+#define SPEED _binary_speed_bin_start
 
 #define DELAY_1MS do{_delay_loop_2(F_CPU/4000);}while(0)
 
+// Step pulse width in timer1 ticks (0.5us)
+#define STEP_PULSE 10
+#define TIMER1_TICK_CYCLES 8
+
+// Time the timer1 interrupts, for the "#I" query
+#ifndef ISR_STATS
+#define ISR_STATS 0
+#endif
+
+// The Y axis runs off timer0, whose ticks are 16us (clock/256): 32 of the
+// lookup table's. Its step pulses end on the first tick after the step.
+#define Y_TICK_SHIFT 5
+#define Y_STEP_PULSE 0
+
 extern const uint8_t LOOKUP_END[] PROGMEM;
 extern const uint8_t LOOKUP[] PROGMEM;
+extern const uint8_t JERK_END[] PROGMEM;
+extern const uint8_t JERK[] PROGMEM;
+extern const uint8_t SPEED[] PROGMEM;
 
 uint8_t scanline[MAX_BUF];
 
-uint16_t image_x, image_y, pixels;
+// The line's width in steps can go past 16 bits, for a wide bed at a fine
+// step; steps are counted in 32 bits for the whole job, well short of where
+// an int32_t position would overflow. Pixels stay 16 bits, as on the wire.
+#define MAX_STEPS 0x40000000UL
+uint32_t image_x;
+uint16_t image_y, pixels;
 uint16_t y_steps_per_scanline;
 uint16_t backlash_comp;
 uint16_t ramp_steps;
 uint16_t velocity;
+uint16_t y_velocity;
+uint16_t ramp_lasering;
+
+// Bits per pixel. With fewer than 8, pixels are packed into each byte, the
+// first in the top bits, and are indexes into a palette of power levels;
+// index 0 is always off.
+uint16_t depth;
+uint8_t palette[16];
+
+// Unpacking: 1 << pack_shift pixels per byte, depth is 1 << depth_shift
+uint8_t pack_shift, pack_mask, depth_shift, value_mask;
+uint16_t line_bytes;    // for a whole line, worked out at the start of the job
+
+// Lines too wide for the scanline buffer are streamed through it instead:
+// the first STREAM_BYTES of it are a ring that each line's data is written
+// into as it arrives, STREAM_CHUNK bytes to a frame, and read out by the
+// step interrupt as it goes. Positions in it count up freely and are masked
+// down. Only data from intact frames (up to stream_commit) is lasered; if
+// the interrupt catches up with it, that's an underrun and the laser stays
+// off for the rest of the job. Streamed lines are all lasered left to
+// right, so that their data can arrive in the order it's needed.
+#define STREAM_BYTES 1024
+#define STREAM_CHUNK 128
+
+uint8_t stream;
+uint16_t stream_write;          // where the next byte goes
+volatile uint16_t stream_commit; // end of the data that can be lasered
+uint16_t stream_read;           // start of the data still to be lasered
+volatile uint8_t underrun;     // 1 when it happens, 2 once it's been reported
 
 // Digital 11 (Variable Spindle PWM) is PB3 (OC2A)
 // Digital 2 (Step Pulse X Axis) is PD2
@@ -36,7 +93,7 @@ uint16_t velocity;
 // Digital 9 (Limit X Axis) is PB1
 // Digital 10 (Limit Y Axis) is PB2
 
-volatile struct {
+typedef struct {
     enum {
         MOVE_NORMAL, MOVE_FROM_TABLE, MOVE_RASTER
     } mode;
@@ -44,15 +101,83 @@ volatile struct {
     uint8_t reverse;
     uint16_t steps;
     uint16_t total_steps;
+    uint16_t rate;  // OCR1A for the first step
+    uint8_t dir;    // X direction, set for rightwards
+    
+    // Table moves: the table entry they speed up to (or slow down from), and
+    // how many steps of the jerk table they tail off over. Raster moves that
+    // laser while speeding up and slowing down (curve isn't 0) do it the same
+    // way as the Y axis, over ramp_steps steps either end, with rate_top in
+    // between; the rate for each step is worked out one step ahead.
+    uint16_t top;
+    uint16_t curve;
+    uint16_t ramp_steps;
+    uint16_t rate_top;
+    uint16_t next_rate;
 
-    // the ratio steps:total_steps matches x:pixels (where scanline[x] is PWM value)
+    // Raster moves step through the scanline with a DDA: each step moves the
+    // pixel index pixel_step whole pixels plus pixel_frac/image_x of a
+    // pixel, so that steps:image_x matches x:pixels (see raster_pwm()). The
+    // accumulator is 16 bits unless image_x is past that (pixel_long).
     // FIXME: badly named. image_x and pixels should basically swap names,
     // as currently pixels is the size of the image and image_x is the distance the head travels.
-    uint16_t pixels;
-    uint16_t scanline_index;
+    const uint8_t *line;
+    uint16_t base;      // streaming: position in the ring of byte 0 of the line
+    uint16_t pixel;
+    uint16_t pixel_step;
+    uint16_t pixel_frac;
+    union {
+        struct {
+            uint16_t pixel_wrap; // image_x - pixel_frac
+            uint16_t pixel_acc;
+        };
+        struct {
+            uint32_t pixel_wrap_long;
+            uint32_t pixel_acc_long;
+        };
+    };
+    
+    // PWM value for the first step, and for the following step worked out
+    // one step ahead
+    uint8_t first_pwm;
+    uint8_t next_pwm;
+    
+    // Set on the last step; the move ends when its pulse does
+    uint8_t stopping;
+    
+    // Lines too long for one move are lasered in several: all but the last
+    // have more set. Ramped ones only speed up at the start of the first
+    // and slow down at the end of the last.
+    uint8_t more;
+    uint8_t ramp_ends;
     
+    // Set for lines over 65535 steps
+    uint8_t pixel_long;
+    
+    // Y steps to start once the last step is made
     uint16_t y_steps;
-} move_cmd;
+} move_t;
+
+// Moves are queued up by the main loop and started by the step interrupt as
+// soon as the one before finishes, so there's no gap between them and the
+// main loop is free to get on with other things while they run.
+#define MOVE_QUEUE 4
+
+volatile move_t move_cmd; // the move being made
+move_t move_queue[MOVE_QUEUE];
+volatile uint8_t move_head, move_tail;
+
+// Y moves speed up through the acceleration table and back down again. They
+// run by themselves, so the Y axis can move on while the X axis turns around.
+volatile struct {
+    uint16_t steps;
+    uint16_t total_steps;
+    uint16_t ramp; // table entries to speed up through (and back down)
+    uint16_t curve; // jerk table steps to tail off over
+    uint16_t ramp_steps; // steps to get up to speed
+    uint8_t stopping;
+    uint8_t running;
+} y_cmd;
 
 typedef enum
 {
@@ -67,9 +192,236 @@ typedef enum
     CMD_BACKLASH,
     CMD_DEPTH,
     CMD_VELOCITY,
-    CMD_START
+    CMD_YVELOCITY,
+    CMD_RAMPLASER,
+    CMD_BAUD,
+    CMD_FLOW,
+    CMD_STATUS,
+    CMD_WINDOW,
+    CMD_ISRSTATS,
+    CMD_TELEMETRY
 } cmd_t;
 
+// Scanline encodings, given by the first byte of each line's data. The sender
+// picks whichever is smallest.
+//
+// Lasered lines only carry their span, the pixels from the first to the last
+// that aren't zero: the type byte is followed by the span's first pixel and
+// its length (16 bits each, LSB first) and then the bytes the span's pixels
+// are in. Packed pixels fill whole bytes, so the ones either side of the span
+// in its first and last bytes come too.
+#define LINE_RAW 'R'    // pixels as they're stored
+#define LINE_RLE 'L'    // run-length packets
+#define LINE_SAME 'S'   // same as the previous line, span and all; nothing else follows
+#define LINE_DELTA 'D'  // run-length packets XORed with the previous line
+#define LINE_BLANK 'B'  // a 16-bit count (LSB first) of blank lines to skip
+
+// Run-length packets: a header below 128 is followed by header + 1 literal
+// bytes, and a header of 128 or more by one byte to repeat header - 126 times.
+
+// Incoming line decoder. It runs from the main loop rather than the RX
+// interrupt, so expanding a long run can't hold off a step.
+//
+// Streamed lines come in several frames. The first is like any other line's,
+// but only carries the first STREAM_CHUNK bytes of it; each of the rest has
+// just a type byte (raw or run-length) and the next STREAM_CHUNK bytes. There
+// are no "same" or delta lines, as the line before is gone by then.
+struct {
+    enum {
+        DECODE_IDLE, DECODE_TYPE, DECODE_ARGS, DECODE_HEADER, DECODE_LITERAL,
+        DECODE_RUN,
+        DECODE_DONE,    // the whole line is in, but not the end of its frame
+        DECODE_SKIP     // something's wrong with it: ignore the rest
+    } state;
+    
+    uint8_t type;
+    uint8_t args[4];
+    uint8_t arg_len;    // bytes received into args
+    
+    uint8_t *line;
+    const uint8_t *prev_line;
+    uint8_t *dst;
+    const uint8_t *prev;
+    uint16_t remaining; // bytes still to come for this line
+    uint16_t count;     // bytes still to come for this packet
+    uint16_t lines;     // image lines covered: 1, or the number of blank ones
+    
+    // Span of the last line with any, which a "same" line shares; zero
+    // after blank ones
+    uint16_t first, end;
+    
+    // Streaming: bytes of the line still to come after the frames taken so
+    // far, and of this frame's
+    uint16_t line_left;
+    uint16_t chunk;
+} decoder;
+
+// Lines are decoded into a ring of slots in the scanline buffer, as many as
+// fit up to LINE_SLOTS, so that the sender can keep sending lines ahead of
+// the one being lasered. A slot is given back once its line has been
+// lasered. Each line's predecessor is the slot before.
+#define LINE_SLOTS 8
+
+struct {
+    uint8_t slots;      // how many fit
+    uint8_t head;       // slot the next line is decoded into
+    uint8_t used;       // slots with a line in, lasered or not
+    uint8_t waiting;    // lines decoded and not yet taken to be lasered
+    
+    struct {
+        uint16_t first, end;    // span; the same if there's nothing to laser
+        uint16_t lines;         // 1, or the number of blank ones
+        uint16_t start;         // streaming: where its data starts
+    } line[LINE_SLOTS];
+} ring;
+
+static inline void decode_put(uint8_t value)
+{
+    if (stream)
+        scanline[stream_write++ & (STREAM_BYTES - 1)] = value;
+    else
+    {
+        if (decoder.type == LINE_DELTA)
+            value ^= *decoder.prev++;
+        *decoder.dst++ = value;
+    }
+    decoder.remaining--;
+}
+
+// The line data proper is next: count bytes of it
+static void decode_data(uint16_t count)
+{
+    decoder.remaining = count;
+    if (decoder.type == LINE_RAW)
+    {
+        decoder.count = count;
+        decoder.state = DECODE_LITERAL;
+    }
+    else
+        decoder.state = DECODE_HEADER;
+}
+
+// The type byte's arguments have all arrived
+static void decode_args()
+{
+    if (decoder.type == LINE_BLANK)
+    {
+        decoder.lines = decoder.args[0] | decoder.args[1] << 8;
+        if (decoder.lines == 0)
+            decoder.lines = 1;
+        decoder.first = decoder.end = 0;
+        decoder.chunk = 0;
+        
+        // The next line may be sent as a change from this blank one
+        if (!stream)
+            memset(decoder.line, 0, line_bytes);
+        decoder.remaining = 0;
+        return;
+    }
+    
+    uint16_t first = decoder.args[0] | decoder.args[1] << 8;
+    uint16_t count = decoder.args[2] | decoder.args[3] << 8;
+    
+    // Don't let a bad span run off the end of the line
+    if (first > pixels)
+        first = pixels;
+    if (count > pixels - first)
+        count = pixels - first;
+    
+    decoder.first = first;
+    decoder.end = first + count;
+    
+    // In bytes from here on
+    first >>= pack_shift;
+    uint16_t end = ((uint32_t)decoder.end + pack_mask) >> pack_shift;
+    if (stream)
+    {
+        decoder.chunk = end - first;
+        if (decoder.chunk > STREAM_CHUNK)
+            decoder.chunk = STREAM_CHUNK;
+        decode_data(decoder.chunk);
+        return;
+    }
+    
+    // Everything outside the span is zero
+    memset(decoder.line, 0, first);
+    memset(decoder.line + end, 0, line_bytes - end);
+    
+    decoder.dst = decoder.line + first;
+    decoder.prev = decoder.prev_line + first;
+    decode_data(end - first);
+}
+
+// Expand the next byte of line data
+static void decode_byte(uint8_t data)
+{
+    switch (decoder.state)
+    {
+        case DECODE_TYPE:
+            decoder.type = data;
+            if (stream && (data == LINE_SAME || data == LINE_DELTA))
+                decoder.state = DECODE_SKIP;
+            else if (stream && decoder.line_left)
+            {
+                // The rest of a streamed line
+                decoder.chunk = decoder.line_left;
+                if (decoder.chunk > STREAM_CHUNK)
+                    decoder.chunk = STREAM_CHUNK;
+                if (data == LINE_RAW || data == LINE_RLE)
+                    decode_data(decoder.chunk);
+                else
+                    decoder.state = DECODE_SKIP;
+            }
+            else if (data == LINE_SAME)
+            {
+                if (decoder.line != decoder.prev_line)
+                    memcpy(decoder.line, decoder.prev_line, line_bytes);
+                decoder.remaining = 0;
+            }
+            else
+            {
+                decoder.arg_len = 0;
+                decoder.state = DECODE_ARGS;
+            }
+            break;
+        case DECODE_ARGS:
+            decoder.args[decoder.arg_len++] = data;
+            if (decoder.arg_len == (decoder.type == LINE_BLANK ? 2 : 4))
+                decode_args();
+            break;
+        case DECODE_HEADER:
+            if (data < 128)
+            {
+                decoder.count = data + 1;
+                decoder.state = DECODE_LITERAL;
+            }
+            else
+            {
+                decoder.count = data - 126;
+                decoder.state = DECODE_RUN;
+            }
+            // Don't let a bad packet run off the end of the line
+            if (decoder.count > decoder.remaining)
+                decoder.count = decoder.remaining;
+            break;
+        case DECODE_LITERAL:
+            decode_put(data);
+            if (--decoder.count == 0)
+                decoder.state = DECODE_HEADER;
+            break;
+        case DECODE_RUN:
+            while (decoder.count--)
+                decode_put(data);
+            decoder.state = DECODE_HEADER;
+            break;
+        default:
+            break;
+    }
+    
+    if (decoder.remaining == 0)
+        decoder.state = DECODE_DONE;
+}
+
 void delay(int time)
 {
    while (time--)
@@ -79,116 +431,227 @@ void delay(int time)
    }
 }
 
-volatile uint8_t running = 0;
-ISR(TIMER1_COMPA_vect)
+static inline uint16_t lookup_delay(uint16_t table_entry)
 {
-    // X axis step pulse stop
-    PORTD &= ~_BV(PORTD2);
-    
-    if (move_cmd.reverse)
+    uint16_t step_delay = pgm_read_byte(LOOKUP + (table_entry * 2));
+    step_delay |= pgm_read_byte(LOOKUP + (table_entry * 2) + 1) << 8;
+    return step_delay;
+}
+
+static inline uint16_t jerk_entry(uint16_t step)
+{
+    uint16_t entry = pgm_read_byte(JERK + (step * 2));
+    entry |= pgm_read_byte(JERK + (step * 2) + 1) << 8;
+    return entry;
+}
+
+// Step rate for each acceleration table entry, as 2^22 / delay
+static inline uint16_t speed_entry(uint16_t table_entry)
+{
+    uint16_t speed = pgm_read_byte(SPEED + (table_entry * 2));
+    speed |= pgm_read_byte(SPEED + (table_entry * 2) + 1) << 8;
+    return speed;
+}
+
+// Speed-ups follow an S-curve. The acceleration table builds up to full
+// acceleration gradually from a standstill; at the other end, rather than
+// going straight along the table to entry top, a speed-up tails off how far
+// along it gets each step over its last curve steps, as given by the jerk
+// table. This is the table entry for the step after step k of a speed-up
+// that takes steps steps.
+static inline uint16_t curve_entry(uint16_t k, uint16_t steps, uint16_t top, uint16_t curve)
+{
+    uint16_t from_end = steps - 1 - k;
+    if (from_end < curve)
+        return top - jerk_entry(from_end);
+    return k;
+}
+
+// raster_advance() for lines over 65535 steps, with a 32-bit accumulator.
+// pixel_step is 0, as there are fewer pixels than steps.
+static inline void raster_advance_long(volatile move_t *move)
+{
+    if (move->reverse)
     {
-        // Reverse: 1023 .. 0
-        if (move_cmd.steps-- == 0)
+        if (move->pixel_acc_long < move->pixel_frac)
         {
-            timer1_stop();
-            running = 0;
-            return;
+            move->pixel--;
+            move->pixel_acc_long += move->pixel_wrap_long;
         }
+        else
+            move->pixel_acc_long -= move->pixel_frac;
     }
     else
     {
-        // Forward: 0 .. 1023
-        if (++move_cmd.steps == move_cmd.total_steps)
+        if (move->pixel_acc_long >= move->pixel_wrap_long)
         {
-            timer1_stop();
-            running = 0;
-            return;
+            move->pixel++;
+            move->pixel_acc_long -= move->pixel_wrap_long;
         }
+        else
+            move->pixel_acc_long += move->pixel_frac;
     }
-        
-    // Move from acceleration lookup table:
-    if (move_cmd.mode == MOVE_FROM_TABLE)
+}
+
+// Move the raster DDA on by one step (in the current direction)
+static inline void raster_advance(volatile move_t *move)
+{
+    // Whole number of pixels per step, including 1:1: no accumulator needed
+    if (move->pixel_frac == 0)
     {
-        uint16_t new_duration = pgm_read_byte(LOOKUP + (move_cmd.steps * 2) + 1) << 8;
-        new_duration |= pgm_read_byte(LOOKUP + (move_cmd.steps * 2));
-        
-        OCR1A = new_duration;
-        OCR1B = new_duration - 10;
+        if (move->reverse)
+            move->pixel -= move->pixel_step;
+        else
+            move->pixel += move->pixel_step;
+        return;
+    }
 
+    if (move->pixel_long)
+    {
+        raster_advance_long(move);
         return;
     }
-    
-    // Raster moves: control PWM value
-    else if (move_cmd.mode == MOVE_RASTER)
+
+    if (move->reverse)
     {
-        // Scale the step number to map it into the range of the scanline.
-        uint32_t offset = move_cmd.steps;
-        offset *= move_cmd.pixels;
-        offset /= move_cmd.total_steps;
-        
-        OCR2A = scanline[move_cmd.scanline_index + (uint16_t)offset];  
+        move->pixel -= move->pixel_step;
+        if (move->pixel_acc < move->pixel_frac)
+        {
+            move->pixel--;
+            move->pixel_acc += move->pixel_wrap;
+        }
+        else
+            move->pixel_acc -= move->pixel_frac;
+    }
+    else
+    {
+        move->pixel += move->pixel_step;
+        if (move->pixel_acc >= move->pixel_wrap)
+        {
+            move->pixel++;
+            move->pixel_acc -= move->pixel_wrap;
+        }
+        else
+            move->pixel_acc += move->pixel_frac;
     }
 }
 
-ISR(TIMER1_COMPB_vect)
+// PWM value for the pixel the raster DDA is on
+static inline uint8_t raster_pwm(volatile move_t *move)
 {
-    // Begin X axis step pulse
-    PORTD |= _BV(PORTD2);
+    uint16_t at = move->pixel;
+    uint16_t byte = (at >> pack_shift) + move->base;
+    if (stream)
+    {
+        if (underrun)
+            return 0;
+        if ((int16_t)(byte - stream_commit) >= 0)
+        {
+            underrun = 1;
+            return 0;
+        }
+        byte &= STREAM_BYTES - 1;
+    }
+    
+    uint8_t data = move->line[byte];
+    if (pack_shift == 0)
+        return data;
+    uint8_t shift = (~at & pack_mask) << depth_shift;
+    return palette[(data >> shift) & value_mask];
 }
 
-struct {
-    int32_t xpos, ypos;
-} state;
-
+#define RAMP_START 1
+#define RAMP_END 2
 
-void stepper_enable()
+// Raster moves lasering while speeding up and slowing down: the rate for
+// step interval i (the one after step i), and next_pwm turned down in
+// proportion to how slow it is, so every pixel gets the same energy
+static inline void raster_ramp(volatile move_t *move, uint16_t i)
 {
-    PORTB &= ~_BV(0);
+    // Steps from the nearer end that has a ramp
+    uint16_t k = move->ramp_steps;
+    if (move->ramp_ends & RAMP_START)
+        k = i;
+    if ((move->ramp_ends & RAMP_END) && move->total_steps - 1 - i < k)
+        k = move->total_steps - 1 - i;
+    if (k + 1 >= move->ramp_steps)
+    {
+        move->next_rate = move->rate_top;
+        return;
+    }
+    
+    uint16_t entry = curve_entry(k, move->ramp_steps, move->top, move->curve);
+    move->next_rate = lookup_delay(entry);
+    
+    // rate_top / delay in 1/65536ths
+    uint32_t scale = ((uint32_t)move->rate_top * speed_entry(entry)) >> 6;
+    if (scale > 0xffff)
+        scale = 0xffff;
+    move->next_pwm = (move->next_pwm * scale + 0x8000) >> 16;
 }
 
-void stepper_disable()
+volatile uint8_t running = 0;
+
+// Set when a raster move is queued and cleared once its last step is made,
+// after which its scanline buffer is free again
+volatile uint8_t lasering = 0;
+
+// Set by the interrupts whenever something the main loop may be waiting for
+// happens, so it doesn't go to sleep just after it's missed it
+volatile uint8_t events = 0;
+
+// Time for telemetry: each of timer2's overflows is a tick. It only ticks
+// during a job, the only time it's needed. In the simulator the overflow
+// interrupt takes 43 of the 2048 clock cycles between ticks (2%), and as it
+// comes first, it can start a step interrupt up to that much later.
+#define CLOCK_TICK_US 128
+volatile uint32_t clock_ticks;
+
+ISR(TIMER2_OVF_vect)
 {
-    PORTB |= _BV(0);
+    clock_ticks++;
 }
 
-inline void setup()
+// Timer2 also runs the laser's PWM, so for the whole of the job rather than
+// being restarted for each line: a line's PWM can start up to one PWM
+// period (128us) into a cycle
+static void clock_start()
 {
-    timer1_init();
-    timer2_init();
-    serial_init();
+    TIFR2 = _BV(TOV2);
+    TIMSK2 |= _BV(TOIE2);
+    timer2_start();
+}
 
-    // ------ output pins -------
-    // Stepper enable (PB0) + Laser enable (PB3)
-    PORTB = 0b00000001; // initial state: stepper drivers disabled
-    DDRB = _BV(PORTB0) | _BV(PORTB3);
-    
-    // X and Y Axis step (PD2 and PD3) + X and Y axis direction (PD5 and PD6)
-    //PORTD = 0b00000000;
-    DDRD = _BV(PORTD2) | _BV(PORTD3) | _BV(PORTD5) | _BV(PORTD6);
-    
-    // Set sane defaults
-    image_x = 0;
-    image_y = 0;
-    
-    sei();
+static void clock_stop()
+{
+    timer2_stop();
+    TIMSK2 &= ~_BV(TOIE2);
 }
 
-/* A flat move with no lasering */
-void flat_move(uint16_t rate, uint16_t steps)
+static uint32_t clock_now()
 {
-    move_cmd.mode = MOVE_NORMAL;
-    move_cmd.reverse = 0;
-    move_cmd.steps = 0;
-    move_cmd.total_steps = steps;
-    OCR1A = rate;
-    OCR1B = rate - 10;
-    running = 1;
-    timer1_start();
-    while(running)
-    {
-    }
+    cli();
+    uint32_t now = clock_ticks;
+    sei();
+    return now;
 }
 
+// Where the job's time goes, for "#T", in clock ticks. The interrupts fill
+// in what happens to the X axis, and the main loop how long it waited for
+// each line's data. Stalls are the waits the X axis stood still for.
+volatile struct {
+    uint32_t start;         // when the job started
+    uint16_t lines_done;    // lasered or passed over
+    uint32_t line_end;      // when the last line lasered finished
+    uint16_t line_motion;   // how long it took, less any stall before it
+    uint16_t line_wait;     // how long the last line's data took to arrive
+    uint32_t line_stall;    // stalled since the last line finished
+    uint32_t stopped;       // when the X axis last stopped
+    uint32_t wait, stall;
+    uint16_t stalls;
+    uint32_t finished;      // when the last job finished
+} telemetry;
+
 void enable_laser_pwm()
 {
     // Enable timer2 OC2A override on PORTB3 pin
@@ -197,8 +660,6 @@ void enable_laser_pwm()
 
 void disable_laser_pwm()
 {
-    timer2_stop();
-    
     // Disable timer2 OC2A override on PORTB3 pin
     TCCR2A &= ~(_BV(COM2A1) | _BV(COM2A0));
     
@@ -206,176 +667,700 @@ void disable_laser_pwm()
     PORTB &= ~_BV(PORTB3);
 }
 
-/* A flat move WITH lasering */
-void raster_move(uint16_t rate, uint16_t steps, uint16_t index, uint8_t reverse)
+static void y_begin(uint16_t steps);
+
+// Take the move at the front of the queue. Called with interrupts off, either
+// from the step interrupts or with the timer stopped.
+static inline void move_start()
 {
-    move_cmd.mode = MOVE_RASTER;
-    move_cmd.reverse = reverse;
-    move_cmd.scanline_index = index;
-    OCR1A = rate;
-    OCR1B = rate - 10;
-    move_cmd.total_steps = steps;
-    move_cmd.pixels = pixels;
+    move_cmd = move_queue[move_tail];
+    move_tail = (move_tail + 1) % MOVE_QUEUE;
+    OCR1A = move_cmd.rate;
     
-    // First pixel PWM value and step counter
-    if (reverse)
+    if (move_cmd.mode == MOVE_RASTER)
     {
-        OCR2A = scanline[index + steps - 1];
-        move_cmd.steps = steps - 1;
+        OCR2A = move_cmd.first_pwm;
+        enable_laser_pwm();
     }
+}
+
+// Direction pin for the move being made. Only changed between step pulses.
+static inline void move_direction()
+{
+    if (move_cmd.dir)
+        PORTD |= _BV(PORTD5);
     else
+        PORTD &= ~_BV(PORTD5);
+}
+
+// The last step of a move has just been made
+static inline void move_end()
+{
+    // Start the Y axis on to the next line without waiting for the main loop
+    if (move_cmd.y_steps)
+        y_begin(move_cmd.y_steps);
+    
+    if (move_cmd.mode == MOVE_RASTER && !move_cmd.more)
     {
-        OCR2A = scanline[index];
-        move_cmd.steps = 0;
+        disable_laser_pwm();
+        lasering = 0;
+        
+        uint32_t took = clock_ticks - telemetry.line_end - telemetry.line_stall;
+        telemetry.line_motion = took > 0xffff ? 0xffff : took;
+        telemetry.line_end = clock_ticks;
+        telemetry.line_stall = 0;
+        telemetry.lines_done++;
     }
-    running = 1;
-    enable_laser_pwm();
-    timer1_start();
-    timer2_start();
     
-    while(running)
+    // Go straight on to the next move, or stop once this pulse is over
+    if (move_head != move_tail)
+        move_start();
+    else
+        move_cmd.stopping = 1;
+    events = 1;
+}
+
+#if ISR_STATS
+// How long the timer1 interrupts take, and how late they start, in timer1
+// ticks. There's no timer to spare, but timer1's own count is the time since
+// the last step, so it's read as each one starts and finishes.
+typedef struct {
+    uint32_t count;
+    uint32_t total;
+    uint16_t least, most;
+    uint16_t latest;        // after the compare match that raised it
+    uint16_t overruns;      // still running when the next step was due
+} isr_stats_t;
+
+volatile isr_stats_t step_stats, pulse_stats;
+
+static inline void isr_stats_add(volatile isr_stats_t *stats, uint16_t match,
+    uint16_t start)
+{
+    uint16_t end = TCNT1;
+    uint16_t ticks = end - start;
+    
+    // The next step came due while it was running, or before it started.
+    // Or the counter's already past the next step and has to go all the way
+    // round first.
+    if (TIFR1 & _BV(OCF1A))
     {
+        if (end < start)
+            ticks += OCR1A + 1;
+        stats->overruns++;
     }
-    disable_laser_pwm();    
+    else if (running && end >= OCR1A)
+        stats->overruns++;
+    
+    stats->count++;
+    stats->total += ticks;
+    if (ticks < stats->least)
+        stats->least = ticks;
+    if (ticks > stats->most)
+        stats->most = ticks;
+    if (start >= match && start - match > stats->latest)
+        stats->latest = start - match;
 }
 
-
-// accelerate from stopped up to step rate, then pad to a number of steps
-// OR in reverse, pad to the number of steps then slow down at the end.
-void accel(uint16_t rate, uint8_t reverse, uint16_t pad_steps)
+static void isr_stats_clear()
 {
-    uint16_t table_entry;
-    uint16_t step_delay = 0;
+    cli();
+    memset((void *)&step_stats, 0, sizeof(step_stats));
+    memset((void *)&pulse_stats, 0, sizeof(pulse_stats));
+    step_stats.least = pulse_stats.least = 0xffff;
+    sei();
+}
+#endif
 
-    for (table_entry = 0; LOOKUP + (table_entry * 2) < LOOKUP_END; table_entry++)
+static inline void x_step()
+{
+    // X axis step pulse start. COMPB ends it STEP_PULSE ticks later: the two
+    // always arrive in that order and COMPA has the higher priority, so the
+    // pulse survives another interrupt holding both of them off.
+    PORTD |= _BV(PORTD2);
+    
+    // Raster moves: the PWM value for this step was looked up during the
+    // previous interrupt, so it always changes right on the step.
+    if (move_cmd.mode == MOVE_RASTER)
+        OCR2A = move_cmd.next_pwm;
+    
+    if (move_cmd.reverse)
     {
-        uint16_t step_delay_candidate = pgm_read_byte(LOOKUP + (table_entry * 2));
-        step_delay_candidate |= pgm_read_byte(LOOKUP + (table_entry * 2) + 1) << 8;
-        
-        if (step_delay_candidate < rate) {
-            break;
+        // Reverse: 1023 .. 0
+        if (move_cmd.steps-- == 0)
+        {
+            move_end();
+            return;
         }
-        
-        step_delay = step_delay_candidate;
-    }
-    
-    // Pad (if in reverse) to the required number of steps
-    if (reverse && table_entry < pad_steps) {
-        flat_move(rate, pad_steps - table_entry);
     }
-
-    // Prepare move_cmd for accelerated move
-    move_cmd.mode = MOVE_FROM_TABLE;
-    if (!reverse)
+    else
     {
-        move_cmd.reverse = 0;
-        move_cmd.steps = 0;
-        move_cmd.total_steps = table_entry + 1;
-    } else {
-        move_cmd.steps = table_entry;
-        move_cmd.reverse = 1;
+        // Forward: 0 .. 1023
+        if (++move_cmd.steps == move_cmd.total_steps)
+        {
+            move_end();
+            return;
+        }
     }
-
-    OCR1A = step_delay;
-    OCR1B = step_delay - 10;
-
-    running = 1;
-    timer1_start();
-    while(running)
+        
+    // Move from acceleration lookup table:
+    if (move_cmd.mode == MOVE_FROM_TABLE)
     {
+        OCR1A = lookup_delay(curve_entry(move_cmd.steps, move_cmd.total_steps,
+            move_cmd.top, move_cmd.curve));
+        return;
     }
     
-    // Pad (if not in reverse) for the remaining number of steps
-    if (reverse == 0 && table_entry < pad_steps) {
-        flat_move(rate, pad_steps - table_entry);
+    // Raster moves: look up the PWM value for the next step
+    else if (move_cmd.mode == MOVE_RASTER)
+    {
+        if (move_cmd.curve)
+            OCR1A = move_cmd.next_rate;
+        
+        // Laser off once the move is over
+        if (move_cmd.reverse ? move_cmd.steps == 0
+            : move_cmd.steps + 1 == move_cmd.total_steps)
+        {
+            move_cmd.next_pwm = 0;
+            return;
+        }
+        
+        raster_advance(&move_cmd);
+        move_cmd.next_pwm = raster_pwm(&move_cmd);
+        if (move_cmd.curve)
+            raster_ramp(&move_cmd, move_cmd.reverse
+                ? move_cmd.total_steps - move_cmd.steps : move_cmd.steps + 1);
     }
 }
 
-void y_advance(uint8_t steps)
+ISR(TIMER1_COMPA_vect)
 {
-    while (steps-- > 0)
-    {
-        PORTD |= _BV(PORTD3);
-        delay(1);
-        PORTD &= ~_BV(PORTD3);                
-        delay(1);
-    }
+#if ISR_STATS
+    uint16_t start = TCNT1;
+    x_step();
+    isr_stats_add(&step_stats, 0, start);
+#else
+    x_step();
+#endif
 }
 
-void test_pattern()
+static inline void x_pulse_end()
 {
-    int i;
-    for (i = 0; i < 1024; i++)
+    // End X axis step pulse
+    PORTD &= ~_BV(PORTD2);
+    
+    // Stop after the last pulse of the move, unless another one has been
+    // queued since
+    if (move_cmd.stopping)
     {
-        if ((i % 256) < 4 || (i % 256) > 251)
-            scanline[i] = 255;
+        move_cmd.stopping = 0;
+        if (move_head != move_tail)
+            move_start();
         else
-            scanline[i] = i % 256;
-    }
+        {
+            timer1_stop();
+            running = 0;
+            telemetry.stopped = clock_ticks;
+        }
+        events = 1;
+    }
+    
+    // The next move may go the other way
+    move_direction();
 }
 
-void vertical_line()
+ISR(TIMER1_COMPB_vect)
 {
-    int i;
-    for (i = 0; i < 1024; i++)
+#if ISR_STATS
+    uint16_t start = TCNT1;
+    x_pulse_end();
+    isr_stats_add(&pulse_stats, STEP_PULSE, start);
+#else
+    x_pulse_end();
+#endif
+}
+
+// Timer0 compare value for a Y step delay from the acceleration table
+static inline uint8_t y_delay(uint16_t table_entry)
+{
+    uint16_t step_delay = lookup_delay(table_entry) >> Y_TICK_SHIFT;
+    if (step_delay > 256)
+        return 255;
+    if (step_delay < Y_STEP_PULSE + 2)
+        return Y_STEP_PULSE + 1;
+    return step_delay - 1;
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+    // Y axis step pulse start; COMPB ends it
+    PORTD |= _BV(PORTD3);
+    
+    if (++y_cmd.steps == y_cmd.total_steps)
     {
-        scanline[i] = 255;
+        y_cmd.stopping = 1;
+        return;
     }
+    
+    // Up the table, along at the top and back down again for the last steps
+    uint16_t k = y_cmd.total_steps - 1 - y_cmd.steps;
+    if (y_cmd.steps < k)
+        k = y_cmd.steps;
+    if (k + 1 >= y_cmd.ramp_steps)
+        OCR0A = y_delay(y_cmd.ramp);
+    else
+        OCR0A = y_delay(curve_entry(k, y_cmd.ramp_steps, y_cmd.ramp, y_cmd.curve));
 }
 
-uint8_t serial_receive_timeout(uint8_t *buf, uint16_t timeout)
+ISR(TIMER0_COMPB_vect)
 {
-    for (; timeout > 0; timeout--)
+    // End Y axis step pulse
+    PORTD &= ~_BV(PORTD3);
+    
+    if (y_cmd.stopping)
     {
-        int16_t result = serial_receive_nowait();
-        if (result >= 0)
-        {
-            *buf = result;
-            return 1;
-        }
-            
-        DELAY_1MS;
+        y_cmd.stopping = 0;
+        timer0_stop();
+        y_cmd.running = 0;
+        events = 1;
     }
-    return 0;
 }
 
-cmd_t get_cmd()
+struct {
+    int32_t xpos, ypos;
+} state;
+
+
+void stepper_enable()
+{
+    PORTB &= ~_BV(0);
+}
+
+void stepper_disable()
 {
-    uint8_t buf[8];
-    while (1)
+    PORTB |= _BV(0);
+}
+
+inline void setup()
+{
+    timer0_init();
+    timer1_init();
+    timer2_init();
+    OCR0B = Y_STEP_PULSE;
+    OCR1B = STEP_PULSE;
+    serial_init();
+    
+    // Sleeping stops the CPU but leaves the timers and serial port running
+    set_sleep_mode(SLEEP_MODE_IDLE);
+
+    // ------ output pins -------
+    // Stepper enable (PB0) + Laser enable (PB3)
+    PORTB = 0b00000001; // initial state: stepper drivers disabled
+    DDRB = _BV(PORTB0) | _BV(PORTB3);
+    
+    // X and Y Axis step (PD2 and PD3) + X and Y axis direction (PD5 and PD6)
+    //PORTD = 0b00000000;
+    DDRD = _BV(PORTD2) | _BV(PORTD3) | _BV(PORTD5) | _BV(PORTD6);
+    
+    // Set sane defaults
+    image_x = 0;
+    image_y = 0;
+    
+    sei();
+}
+
+void idle();
+
+// Wait for all the queued moves to finish
+void wait_for_move()
+{
+    while (running)
+        idle();
+}
+
+// Wait for the last raster move queued to finish with its scanline
+void raster_wait()
+{
+    while (lasering)
+        idle();
+}
+
+// Steps left before the last raster move queued finishes, at least. It has
+// to be the last move queued.
+uint16_t raster_left()
+{
+    uint16_t left;
+    cli();
+    if (!lasering)
+        left = 0;
+    else if (move_head != move_tail)
+        left = move_queue[(move_head + MOVE_QUEUE - 1) % MOVE_QUEUE].total_steps;
+    else if (move_cmd.reverse)
+        left = move_cmd.steps;
+    else
+        left = move_cmd.total_steps - move_cmd.steps;
+    sei();
+    return left;
+}
+
+// Add a move to the queue, waiting for room, and start it if the X axis is
+// stopped
+void move_queue_add(const move_t *move)
+{
+    uint8_t next = (move_head + 1) % MOVE_QUEUE;
+    while (next == move_tail)
+        idle();
+    
+    move_queue[move_head] = *move;
+    
+    cli();
+    move_head = next;
+    if (!running)
     {
-        buf[0] = serial_receive();
-        if (buf[0] != '#')
-            continue;
-        
-        uint8_t result = serial_receive_timeout(buf + 1, 250);
-        if (result == 0)
-            continue;
-            
-        switch (buf[1])
-        {
-            case '#':
-                return CMD_HANDSHAKE;
-            case 'X':
-                return CMD_IMAGEX;
-            case 'P':
-                return CMD_PIXELS;
-            case 'Y':
-                return CMD_IMAGEY;
-            case 'B':
-                return CMD_BACKLASH;
-            case 'S':
-                return CMD_YSTEPS;
-            case 'R':
-                return CMD_RAMP;
-            case 'V':
-                return CMD_VELOCITY;
-            case '!':
-                return CMD_START;
-            default:
-                return CMD_UNKNOWN;
+        move_start();
+        move_direction();
+        running = 1;
+        timer1_start();
+    }
+    sei();
+}
+
+// The direction of the moves being planned (set for rightwards)
+uint8_t x_dir;
+
+// Set X direction for the moves that follow
+void x_direction(uint8_t reverse)
+{
+    x_dir = !reverse;
+}
+
+// Keep track of where the X axis will be after a move of this many steps.
+// state.xpos is where the last move queued finishes, not where the head is.
+static void x_moved(uint32_t steps)
+{
+    if (x_dir)
+        state.xpos += steps;
+    else
+        state.xpos -= steps;
+}
+
+/* A flat move with no lasering. Moves count their steps in 16 bits, so a
+ * longer one is made as several, back to back. */
+void flat_move(uint16_t rate, uint32_t steps)
+{
+    while (steps > 0)
+    {
+        uint16_t part = steps > 0xffff ? 0xffff : steps;
+        move_t move;
+        move.mode = MOVE_NORMAL;
+        move.reverse = 0;
+        move.steps = 0;
+        move.total_steps = part;
+        move.rate = rate;
+        move.dir = x_dir;
+        move.stopping = 0;
+        move.y_steps = 0;
+        move_queue_add(&move);
+        x_moved(part);
+        steps -= part;
+    }
+}
+
+uint16_t accel_entries(uint16_t rate);
+uint16_t curve_for(uint16_t table_entry);
+uint16_t curve_steps(uint16_t table_entry, uint16_t curve);
+
+/* One move of raster_move()'s, over steps first to last - 1 of the line,
+ * and no more than 0xffff of them. It speeds up or slows down at the ends
+ * in ramp_ends, and more is set unless it's the last. */
+static void raster_part(uint16_t rate, uint32_t first, uint32_t last, const uint8_t *line,
+    uint16_t base, uint8_t reverse, uint16_t y_steps, uint8_t ramp_ends, uint8_t more)
+{
+    uint16_t steps = last - first;
+    move_t move;
+    move.mode = MOVE_RASTER;
+    move.reverse = reverse;
+    move.rate = rate;
+    move.dir = x_dir;
+    move.total_steps = steps;
+    move.stopping = 0;
+    move.more = more;
+    move.ramp_ends = ramp_ends;
+    move.y_steps = y_steps;
+    
+    // Set up the DDA for the whole move: step x is on pixel x * pixels / image_x.
+    // These are the only divisions for the whole move, and x * pixels can
+    // take up to 48 bits.
+    move.pixel_step = pixels / image_x;
+    move.pixel_frac = pixels % image_x;
+    move.pixel_long = image_x > 0xffff;
+    if (move.pixel_long)
+        move.pixel_wrap_long = image_x - move.pixel_frac;
+    else
+        move.pixel_wrap = image_x - move.pixel_frac;
+    
+    // First pixel PWM value and step counter
+    uint32_t acc;
+    move.line = line;
+    move.base = base;
+    move.pixel = longmuldiv(reverse ? last - 1 : first, pixels, image_x, &acc);
+    if (move.pixel_long)
+        move.pixel_acc_long = acc;
+    else
+        move.pixel_acc = acc;
+    move.steps = reverse ? steps - 1 : 0;
+    move.next_pwm = raster_pwm(&move);
+    
+    // Lasering while speeding up and slowing down, with the same S-curve as
+    // the other moves
+    move.curve = 0;
+    if (ramp_ends)
+    {
+        move.top = accel_entries(rate);
+        if (move.top)
+            move.top--; // the last entry no faster than rate
+        move.curve = curve_for(move.top);
+        move.ramp_steps = curve_steps(move.top, move.curve);
+        move.rate_top = rate;
+        raster_ramp(&move, 0);
+        move.rate = move.next_rate;
+    }
+    move.first_pwm = move.next_pwm;
+    
+    // ...and the one after it
+    if (steps > 1)
+    {
+        raster_advance(&move);
+        move.next_pwm = raster_pwm(&move);
+        if (ramp_ends)
+            raster_ramp(&move, 1);
+    }
+    else
+        move.next_pwm = 0;
+    
+    move_queue_add(&move);
+    x_moved(steps);
+}
+
+/* A flat move WITH lasering, over steps first to last - 1 of the line. The Y
+ * axis starts on by y_steps as soon as it's done. If ramped is set, it
+ * speeds up from stopped and slows back down to stopped along the way
+ * instead. Streaming, line is the ring and base where the line is in it.
+ * Lines of more than 0xffff steps are split into moves of equal length
+ * (so each is far longer than any ramp), made one after the other. */
+void raster_move(uint16_t rate, uint32_t first, uint32_t last, const uint8_t *line,
+    uint16_t base, uint8_t reverse, uint16_t y_steps, uint8_t ramped)
+{
+    if (last <= first)
+        return;
+    
+    uint32_t steps = last - first;
+    uint16_t parts = (steps + 0xfffe) / 0xffff;
+    uint16_t size = steps / parts, longer = steps % parts;
+    
+    // The Y axis counts as moving from now on, so y_wait() waits for it
+    if (y_steps)
+        y_cmd.running = 1;
+    lasering = 1;
+    
+    // In the order they're lasered: from the right, going in reverse
+    uint16_t i;
+    for (i = 0; i < parts; i++)
+    {
+        uint16_t k = reverse ? parts - 1 - i : i;
+        uint32_t from = first + (uint32_t)k * size + (k < longer ? k : longer);
+        uint32_t to = from + size + (k < longer);
+        uint8_t ends = 0;
+        if (ramped && i == 0)
+            ends |= RAMP_START;
+        if (ramped && i == parts - 1)
+            ends |= RAMP_END;
+        raster_part(rate, from, to, line, base, reverse,
+            i == parts - 1 ? y_steps : 0, ends, i < parts - 1);
+    }
+}
+
+// The acceleration lookup table entry where the step rate reaches rate, or
+// its last entry for rates faster than the table goes
+uint16_t accel_entries(uint16_t rate)
+{
+    uint16_t last = (LOOKUP_END - LOOKUP) / 2 - 1;
+    uint16_t table_entry;
+
+    for (table_entry = 0; table_entry < last; table_entry++)
+    {
+        if (lookup_delay(table_entry) < rate) {
+            break;
         }
     }
+    return table_entry;
+}
+
+// How many steps of the jerk table a speed-up to table_entry tails off
+// over: all of them, unless it's too short for that. Never more than the
+// table_entry + 1 steps that going straight along the table would take.
+uint16_t curve_for(uint16_t table_entry)
+{
+    uint16_t curve = (JERK_END - JERK) / 2;
+    if (curve > table_entry + 1)
+        curve = table_entry + 1;
+    while (curve > 1 && jerk_entry(curve - 1) > table_entry)
+        curve--;
+    return curve;
+}
+
+// Steps taken to speed up to table_entry, tailing off over curve steps
+uint16_t curve_steps(uint16_t table_entry, uint16_t curve)
+{
+    return table_entry + curve - jerk_entry(curve - 1);
+}
+
+// Steps taken to speed up from stopped to step rate
+uint16_t accel_steps(uint16_t rate)
+{
+    uint16_t table_entry = accel_entries(rate);
+    return curve_steps(table_entry, curve_for(table_entry));
+}
+
+// Accelerate through the lookup table from stopped up to table_entry,
+// OR in reverse, slow down from table_entry to stopped. Either way
+// it takes curve_steps() steps.
+void table_move(uint16_t table_entry, uint8_t reverse)
+{
+    uint16_t curve = curve_for(table_entry);
+    uint16_t steps = curve_steps(table_entry, curve);
+    
+    // Prepare an accelerated move
+    move_t move;
+    move.mode = MOVE_FROM_TABLE;
+    move.dir = x_dir;
+    move.stopping = 0;
+    move.y_steps = 0;
+    move.total_steps = steps;
+    move.top = table_entry;
+    move.curve = curve;
+    if (!reverse)
+    {
+        move.reverse = 0;
+        move.steps = 0;
+        move.rate = lookup_delay(0);
+    } else {
+        move.steps = steps - 1;
+        move.reverse = 1;
+        move.rate = lookup_delay(steps > 1
+            ? curve_entry(steps - 2, steps, table_entry, curve) : 0);
+    }
+
+    move_queue_add(&move);
+    x_moved(steps);
+}
+
+// accelerate from stopped up to step rate, then pad to a number of steps
+// OR in reverse, pad to the number of steps then slow down at the end.
+// Either way the move is pad_steps + 1 steps long, unless getting up to
+// speed takes longer than that.
+void accel(uint16_t rate, uint8_t reverse, uint32_t pad_steps)
+{
+    uint16_t table_entry = accel_entries(rate);
+    uint16_t steps = curve_steps(table_entry, curve_for(table_entry));
+    
+    // Pad (if in reverse) to the required number of steps
+    if (reverse && steps <= pad_steps) {
+        flat_move(rate, pad_steps + 1 - steps);
+    }
+
+    table_move(table_entry, reverse);
+    
+    // Pad (if not in reverse) for the remaining number of steps
+    if (reverse == 0 && steps <= pad_steps) {
+        flat_move(rate, pad_steps + 1 - steps);
+    }
+}
+
+// Move the X axis the given number of steps with the laser off, getting as
+// close to velocity as there's room for
+void x_travel(uint32_t steps)
+{
+    if (steps < 2)
+    {
+        flat_move(lookup_delay(0), steps);
+        return;
+    }
+    
+    // Speeding up to table_entry takes at least table_entry + 1 steps, and
+    // just the one step for entry 0
+    uint16_t table_entry = accel_entries(velocity);
+    if (table_entry > steps / 2 - 1)
+        table_entry = steps / 2 - 1;
+    uint16_t ramp = curve_steps(table_entry, curve_for(table_entry));
+    while (ramp > steps / 2)
+    {
+        table_entry--;
+        ramp = curve_steps(table_entry, curve_for(table_entry));
+    }
+    
+    table_move(table_entry, 0);
+    flat_move(lookup_delay(table_entry), steps - 2 * ramp);
+    table_move(table_entry, 1);
+}
+
+// Wait for the Y axis to finish moving
+void y_wait()
+{
+    while (y_cmd.running)
+        idle();
+}
+
+// Set the Y axis moving on by steps. Called with interrupts off, or with the
+// Y axis stopped.
+static void y_begin(uint16_t steps)
+{
+    y_cmd.steps = 0;
+    y_cmd.total_steps = steps;
+    y_cmd.running = 1;
+    OCR0A = y_delay(0);
+    timer0_start();
+}
+
+// Start the Y axis moving on by steps. It carries on by itself; y_wait()
+// waits for it to get there.
+void y_start(uint16_t steps)
+{
+    y_wait();
+    if (steps == 0)
+        return;
+    y_begin(steps);
+}
+
+void y_advance(uint32_t steps)
+{
+    while (steps > 0xffff)
+    {
+        y_start(0xffff);
+        steps -= 0xffff;
+    }
+    y_start(steps);
+}
+
+void test_pattern()
+{
+    int i;
+    for (i = 0; i < 1024; i++)
+    {
+        if ((i % 256) < 4 || (i % 256) > 251)
+            scanline[i] = 255;
+        else
+            scanline[i] = i % 256;
+    }
+}
+
+void vertical_line()
+{
+    int i;
+    for (i = 0; i < 1024; i++)
+    {
+        scanline[i] = 255;
+    }
 }
 
 void debug_send(uint16_t num)
@@ -409,128 +1394,956 @@ void debug_send(uint16_t num)
     serial_sendchar('\n');
 }
 
-int16_t read_number_argument()
-{
-    uint8_t buffer[10];
-    uint8_t digit = 0;
+// Everything but the handshake and the status query comes in frames, so
+// that anything lost or mangled on the way gets noticed and sent again
+// rather than ending up on the workpiece. Each frame is COBS-encoded
+// between two zero bytes, so where it starts and ends can't be mistaken:
+//
+//     0, COBS(seq, type, length (16 bits), payload, CRC (16 bits)), 0
+//
+// Numbers are LSB first. seq goes from 0 to 63 and on by one for each new
+// frame; the CRC is CCITT (avr-libc's _crc_ccitt_update() from 0xffff) of
+// everything before it. Frames are taken strictly in order, and get replies:
+//
+//     #K<seq>  done, along with every frame before it
+//     #N<seq>  refused: a bad setting, not while a job is running, or no
+//              room for a line. Send it again or give up.
+//     #R<seq>  damaged or missing: send everything again from seq. Sent
+//              for the first damaged frame, and for intact ones from after
+//              it, but no more often than every RESEND_TICKS.
+//
+// where <seq> is '0' + seq followed by '0' + (seq ^ 63). A frame from
+// before the one expected (sent again because its reply went missing) gets
+// "#K" for the last one taken and is otherwise ignored; one from after it
+// is ignored too (the one expected was damaged or lost, and gets sent again
+// along with it).
+//
+// Lines don't wait to be asked for one at a time. During a job the
+// controller gives the sender credit for as many lines as it has slots free
+// with "#D<seq>": lines can be sent up to but not including seq, without
+// waiting for each reply. "#D" from the sender asks for it again.
+#define FRAME_SETTING 'P' // a command letter and its value (32 bits)
+#define FRAME_PALETTE 'C' // power for packed pixel values 1 and up, after 'G'
+#define FRAME_START '!'   // start the job
+#define FRAME_LINE 'D'    // a line of image data
+
+#define FRAME_SEQS 64
+#define FRAME_OVERHEAD 6  // seq, type, length and CRC
+#define RESEND_TICKS 160  // 20ms: longer than the sender takes to go back
+#define SETTING_LEN 5
+
+struct {
+    enum {
+        FRAME_OUTSIDE, FRAME_INSIDE
+    } state;
+    uint8_t empty;      // nothing but zeros since the frame started
     
-    // Read digits
-    while (1)
+    // COBS decoding: bytes left in this block, and whether a zero is due
+    // before the next one
+    uint8_t block;
+    uint8_t zero;
+    
+    uint16_t count;     // bytes of the frame decoded so far
+    uint16_t crc;
+    uint8_t seq;
+    uint8_t type;
+    uint16_t len;
+    uint8_t arg[15];    // setting and palette frames' payload
+    uint8_t fed;        // payload has gone to the line decoder
+    
+    uint8_t expected;   // seq of the next frame to take
+    uint8_t damaged;    // expected when the last damaged one was reported
+    uint32_t asked;     // clock tick when "#R" was last sent
+    uint32_t baud;      // baud rate to switch to once the reply's gone
+} frame;
+
+// Outside frames only the handshake "##", the status query "#Q", the
+// credit query "#D", the interrupt timing query "#I" and the telemetry query
+// "#T" are understood, so that stray bytes can't change anything
+struct {
+    enum {
+        PARSE_IDLE, PARSE_COMMAND
+    } state;
+} parser;
+
+uint8_t busy;       // a job is running; settings can't be changed
+uint8_t start_job;  // start frame received
+uint16_t job_line;  // lines finished so far
+
+cmd_t command_for(uint8_t c)
+{
+    switch (c)
+    {
+        case '#':
+            return CMD_HANDSHAKE;
+        case 'X':
+            return CMD_IMAGEX;
+        case 'P':
+            return CMD_PIXELS;
+        case 'Y':
+            return CMD_IMAGEY;
+        case 'B':
+            return CMD_BACKLASH;
+        case 'S':
+            return CMD_YSTEPS;
+        case 'R':
+            return CMD_RAMP;
+        case 'V':
+            return CMD_VELOCITY;
+        case 'U':
+            return CMD_YVELOCITY;
+        case 'A':
+            return CMD_RAMPLASER;
+        case 'L':
+            return CMD_BAUD;
+        case 'F':
+            return CMD_FLOW;
+        case 'Q':
+            return CMD_STATUS;
+        case 'G':
+            return CMD_DEPTH;
+        case 'D':
+            return CMD_WINDOW;
+        case 'I':
+            return CMD_ISRSTATS;
+        case 'T':
+            return CMD_TELEMETRY;
+        default:
+            return CMD_UNKNOWN;
+    }
+}
+
+void send_number(uint32_t num)
+{
+    char buf[11];
+    uint8_t i = sizeof(buf) - 1;
+    buf[i] = 0;
+    do
     {
-        uint8_t result = serial_receive_timeout(buffer + digit, 100);
-        if (result == 0)
-            return -1;
-        if (buffer[digit] == ';')
+        buf[--i] = '0' + num % 10;
+        num /= 10;
+    } while (num);
+    serial_send(buf + i);
+}
+
+// Set the bits per pixel: 1, 2, 4 or 8. The palette is spread evenly until
+// the sender gives one.
+static uint8_t set_depth(uint8_t bits)
+{
+    for (depth_shift = 0; depth_shift < 4; depth_shift++)
+    {
+        if (bits == 1 << depth_shift)
             break;
-        if (buffer[digit] < '0' || buffer[digit] > '9')
-            return -1;
-        // 5-digit maximum
-        if (digit == 5)
-            return -1;
-        digit++;
     }
+    if (depth_shift == 4)
+        return 0;
+    
+    depth = bits;
+    pack_shift = 3 - depth_shift;
+    pack_mask = (1 << pack_shift) - 1;
+    value_mask = (1 << bits) - 1;
     
-    int16_t result = 0;
     uint8_t i;
-    for (i = 0; i < digit; i++)
+    if (depth < 8)
     {
-        result *= 10;
-        result += buffer[i] - '0';
+        for (i = 0; i <= value_mask; i++)
+            palette[i] = i * 255 / value_mask;
     }
-    return result;
+    return 1;
 }
 
-void begin_lasering()
+// A setting has arrived. Returns whether it was taken.
+static uint8_t command_argument(cmd_t cmd, uint32_t value)
 {
-    // Enable stepper motors
-    stepper_enable();
-    delay(100);
+    if (busy)
+        return 0;
     
-    // Positive Y direction
-    PORTD |= _BV(PORTD6);
-
-    uint16_t line;
-    for (line = 0; line < image_y; line++)
+    if (cmd == CMD_DEPTH)
+        return value <= 8 && set_depth(value);
+    
+    // Link settings. The baud rate changes once the reply has gone out.
+    if (cmd == CMD_BAUD)
     {
-        uint8_t reverse = line % 2;
-        
-        // Get next line of image data
-        serial_send("#D");
-        uint16_t x;
-        for (x = 0; x < pixels; x++)
-        {
-            // read bytes
-            uint8_t pixel = serial_receive();
-            scanline[x] = pixel;
-        }
-      
-        // Set direction (bit set for rightwards, bit clear for leftwards)
-        if (reverse)
-            PORTD &= ~_BV(PORTD5);
-        else
-            PORTD |= _BV(PORTD5);
-            
-        accel(velocity, 0, ramp_steps); // speed up
-        raster_move(velocity, image_x, 0, reverse);
-        accel(velocity, 1, ramp_steps); // slow down
-
-        // step Y+
-        y_advance(y_steps_per_scanline);
+        if (serial_ubrr(value) < 0)
+            return 0;
+        frame.baud = value;
+        return 1;
+    }
+    if (cmd == CMD_FLOW)
+    {
+        if (value > FLOW_RTSCTS)
+            return 0;
+        serial_set_flow(value);
+        return 1;
     }
-
-    stepper_disable();
-}
-
-void main_loop()
-{
-    // Wait for a command
-    cmd_t command = get_cmd();
     
-    // Process that command
-    switch (command)
+    // The only 32-bit one
+    if (cmd == CMD_IMAGEX)
+    {
+        if (value == 0 || value > MAX_STEPS)
+            return 0;
+        image_x = value;
+        return 1;
+    }
+    
+    uint16_t *setting;
+    switch (cmd)
     {
-        case CMD_HANDSHAKE:
-            serial_send("##");
-            break;
-        case CMD_IMAGEX:
-            image_x = read_number_argument();
-            serial_send("#Y");
-            break;
         case CMD_PIXELS:
-            pixels = read_number_argument();
-            serial_send("#Y");
+            setting = &pixels;
             break;
         case CMD_IMAGEY:
-            image_y = read_number_argument();
-            serial_send("#Y");
+            setting = &image_y;
             break;
         case CMD_BACKLASH:
-            backlash_comp = read_number_argument();
-            serial_send("#Y");
+            setting = &backlash_comp;
             break;
         case CMD_YSTEPS:
-            y_steps_per_scanline = read_number_argument();
-            serial_send("#Y");
+            setting = &y_steps_per_scanline;
             break;
         case CMD_RAMP:
-            ramp_steps = read_number_argument();
-            serial_send("#Y");
+            setting = &ramp_steps;
             break;
         case CMD_VELOCITY:
-            velocity = read_number_argument();
-            serial_send("#Y");
+            setting = &velocity;
             break;
-        case CMD_START:
-            serial_send("#Y");
-            begin_lasering();
+        case CMD_YVELOCITY:
+            setting = &y_velocity;
+            break;
+        case CMD_RAMPLASER:
+            setting = &ramp_lasering;
+            break;
+        default:
+            return 0;
+    }
+    
+    if (value > 0xffff || (cmd == CMD_PIXELS && value == 0))
+        return 0;
+    *setting = value;
+    return 1;
+}
+
+static void send_window();
+
+// Numbers for "#T" go as hex, LSB first, rather than bytes: XON/XOFF flow
+// control would eat any 0x11 or 0x13 among them
+static void send_hex(uint32_t value, uint8_t bytes)
+{
+    static const char digits[] = "0123456789abcdef";
+    while (bytes--)
+    {
+        serial_sendchar(digits[(value >> 4) & 0xf]);
+        serial_sendchar(digits[value & 0xf]);
+        value >>= 8;
+    }
+}
+
+// "#T<counters>;", each counter a fixed number of bytes:
+//
+//     line (2)         the line being worked on
+//     lines done (2)   lasered or passed over
+//     lines (2)        in the job
+//     elapsed (4)      since the job started, in 128us clock ticks
+//     line motion (2)  ticks the last line lasered took, less any stall
+//     line wait (2)    ticks the latest line's data took to arrive
+//     wait (4)         ticks spent waiting for data, all told
+//     stall (4)        of which the X axis stood still
+//     stalls (2)       times it stood still
+//     rx overruns (2), rx dropped (2), rx high (1), tx high (1)
+//                      from the serial port, since power-on
+//     busy (1)         1 until the job's finished
+static void send_telemetry()
+{
+    struct serial_stats serial;
+    serial_get_stats(&serial);
+    uint32_t now = clock_now();
+    
+    cli();
+    uint16_t lines_done = telemetry.lines_done;
+    uint16_t line_motion = telemetry.line_motion;
+    sei();
+    
+    serial_send("#T");
+    send_hex(job_line, 2);
+    send_hex(lines_done, 2);
+    send_hex(image_y, 2);
+    send_hex((busy ? now : telemetry.finished) - telemetry.start, 4);
+    send_hex(line_motion, 2);
+    send_hex(telemetry.line_wait, 2);
+    send_hex(telemetry.wait, 4);
+    send_hex(telemetry.stall, 4);
+    send_hex(telemetry.stalls, 2);
+    send_hex(serial.rx_overruns, 2);
+    send_hex(serial.rx_dropped, 2);
+    send_hex(serial.rx_high, 1);
+    send_hex(serial.tx_high, 1);
+    send_hex(busy, 1);
+    serial_sendchar(';');
+}
+
+#if ISR_STATS
+// "<count>,<least>,<mean>,<most>,<latest start>,<overruns>;", in clock cycles
+static void send_isr_stats(const volatile isr_stats_t *stats)
+{
+    cli();
+    isr_stats_t copy = *stats;
+    sei();
+    
+    send_number(copy.count);
+    serial_sendchar(',');
+    send_number(copy.count ? (uint32_t)copy.least * TIMER1_TICK_CYCLES : 0);
+    serial_sendchar(',');
+    send_number(copy.count ? copy.total / copy.count * TIMER1_TICK_CYCLES : 0);
+    serial_sendchar(',');
+    send_number((uint32_t)copy.most * TIMER1_TICK_CYCLES);
+    serial_sendchar(',');
+    send_number((uint32_t)copy.latest * TIMER1_TICK_CYCLES);
+    serial_sendchar(',');
+    send_number(copy.overruns);
+    serial_sendchar(';');
+}
+#endif
+
+static void parse_byte(uint8_t data)
+{
+    if (parser.state == PARSE_IDLE)
+    {
+        if (data == '#')
+            parser.state = PARSE_COMMAND;
+        return;
+    }
+    
+    parser.state = PARSE_IDLE;
+    switch (command_for(data))
+    {
+        case CMD_HANDSHAKE:
+            // A new sender starts its frames from scratch
+            if (!busy)
+            {
+                frame.expected = 0;
+                frame.damaged = FRAME_SEQS;
+            }
+            serial_send("##");
+            break;
+        case CMD_STATUS:
+            // Progress: "#Q<line>/<lines>;"
+            serial_send("#Q");
+            send_number(job_line);
+            serial_sendchar('/');
+            send_number(image_y);
+            serial_sendchar(';');
+            break;
+        case CMD_WINDOW:
+            send_window();
+            break;
+        case CMD_TELEMETRY:
+            send_telemetry();
+            break;
+#if ISR_STATS
+        case CMD_ISRSTATS:
+            // Timer1's interrupts since the job started: "#I<step><pulse>"
+            serial_send("#I");
+            send_isr_stats(&step_stats);
+            send_isr_stats(&pulse_stats);
             break;
-        case CMD_UNKNOWN:
+#endif
         default:
             serial_send("#?");
             break;
     }
 }
 
+// Start the line being decoded over again, after its frame was damaged.
+// Streaming, that's just the frame's part of it.
+static void decode_restart()
+{
+    decoder.remaining = line_bytes;
+    decoder.lines = 1;
+    decoder.state = DECODE_TYPE;
+    stream_write = stream_commit;
+}
+
+// Streaming: room left in the ring
+static inline uint16_t stream_free()
+{
+    return STREAM_BYTES - (uint16_t)(stream_commit - stream_read);
+}
+
+// Start decoding the next line into the next slot, if there's one free and
+// the decoder isn't already busy with one. Streaming, the slots only hold
+// where each line is, and the next frame needs room in the ring too.
+static void ring_next()
+{
+    if (decoder.state != DECODE_IDLE)
+        return;
+    if (stream)
+    {
+        if ((ring.used < ring.slots || decoder.line_left)
+            && stream_free() >= STREAM_CHUNK)
+            decode_restart();
+        return;
+    }
+    if (ring.used == ring.slots)
+        return;
+    decoder.line = scanline + ring.head * line_bytes;
+    decoder.prev_line = scanline
+        + (ring.head ? ring.head - 1 : ring.slots - 1) * line_bytes;
+    decode_restart();
+}
+
+// A line has been decoded into its slot. Streaming, it's only a frame's
+// worth of one: the line's slot is taken by its first frame, and it can be
+// lasered as soon as there's enough of it.
+static void ring_decoded()
+{
+    if (stream)
+    {
+        uint8_t first_frame = !decoder.line_left;
+        if (first_frame)
+        {
+            decoder.line_left = ((uint32_t)decoder.end + pack_mask) >> pack_shift;
+            decoder.line_left -= decoder.first >> pack_shift;
+            ring.line[ring.head].start = stream_commit;
+        }
+        decoder.line_left -= decoder.chunk;
+        cli();
+        stream_commit = stream_write;
+        sei();
+        if (!first_frame)
+        {
+            decoder.state = DECODE_IDLE;
+            ring_next();
+            return;
+        }
+    }
+    
+    ring.line[ring.head].first = decoder.first;
+    ring.line[ring.head].end = decoder.end;
+    ring.line[ring.head].lines = decoder.lines;
+    if (++ring.head == ring.slots)
+        ring.head = 0;
+    ring.used++;
+    ring.waiting++;
+    decoder.state = DECODE_IDLE;
+    ring_next();
+}
+
+// The next line to laser, once it's been decoded
+static uint8_t ring_take()
+{
+    while (!ring.waiting)
+        idle();
+    return (ring.head + ring.slots - ring.waiting--) % ring.slots;
+}
+
+// A line's data has arrived, having been wanted since then. If the X axis
+// ran out of moves and stopped in the meantime, it was held up by the link.
+static void line_arrived(uint32_t since)
+{
+    uint32_t now = clock_now();
+    uint32_t wait = now - since;
+    telemetry.line_wait = wait > 0xffff ? 0xffff : wait;
+    telemetry.wait += wait;
+    
+    cli();
+    if (!running)
+    {
+        uint32_t stall = now - (telemetry.stopped > since ? telemetry.stopped : since);
+        telemetry.line_stall += stall;
+        telemetry.stall += stall;
+        telemetry.stalls++;
+    }
+    sei();
+}
+
+// Replies carry a seq twice, the second time inverted, so that a damaged
+// one can't be taken for another
+static void send_reply(uint8_t reply, uint8_t seq)
+{
+    seq &= FRAME_SEQS - 1;
+    serial_sendchar('#');
+    serial_sendchar(reply);
+    serial_sendchar('0' + seq);
+    serial_sendchar('0' + (seq ^ (FRAME_SEQS - 1)));
+}
+
+// Tell the sender how far it can go: a line for each slot free, counting
+// the one being decoded into. Streaming, a frame for each chunk of room in
+// the ring too, whichever's fewer.
+static void send_window()
+{
+    uint8_t room = ring.slots - ring.used;
+    if (stream && stream_free() / STREAM_CHUNK < room)
+        room = stream_free() / STREAM_CHUNK;
+    send_reply('D', frame.expected + room);
+}
+
+// Give back the oldest slot once its line has been lasered
+static void ring_free()
+{
+    if (stream)
+    {
+        // All of its data's been used
+        uint8_t oldest = (ring.head + ring.slots - ring.used) % ring.slots;
+        uint16_t end = ring.line[oldest].start
+            + (((uint32_t)ring.line[oldest].end + pack_mask) >> pack_shift)
+            - (ring.line[oldest].first >> pack_shift);
+        if ((int16_t)(end - stream_read) > 0)
+            stream_read = end;
+    }
+    ring.used--;
+    ring_next();
+    send_window();
+}
+
+// Streaming: give back the ring the step interrupt has gone past, and tell
+// the sender once there's another chunk of it
+static void stream_release()
+{
+    // Ran out of data: "#U<line>;" for the line it happened on, and the job
+    // stops once it's done
+    if (underrun == 1)
+    {
+        underrun = 2;
+        serial_send("#U");
+        send_number(job_line);
+        serial_sendchar(';');
+    }
+    
+    uint16_t read = stream_read;
+    cli();
+    if (lasering && move_cmd.mode == MOVE_RASTER)
+        read = (move_cmd.pixel >> pack_shift) + move_cmd.base;
+    sei();
+    
+    uint8_t chunks = stream_free() / STREAM_CHUNK;
+    if ((int16_t)(read - stream_read) <= 0)
+        return;
+    stream_read = read;
+    if (stream_free() / STREAM_CHUNK == chunks)
+        return;
+    ring_next();
+    send_window();
+}
+
+static void frame_begin()
+{
+    frame.state = FRAME_INSIDE;
+    frame.empty = 1;
+    frame.block = 0;
+    frame.zero = 0;
+    frame.count = 0;
+    frame.crc = 0xffff;
+    frame.fed = 0;
+}
+
+// The next byte of a frame, once it's been COBS decoded. Line data goes
+// straight to the line decoder rather than being held until the CRC has
+// been checked: there isn't room for it.
+static void frame_put(uint8_t data)
+{
+    uint16_t at = frame.count++;
+    frame.crc = _crc_ccitt_update(frame.crc, data);
+    
+    if (at == 0)
+        frame.seq = data;
+    else if (at == 1)
+        frame.type = data;
+    else if (at == 2)
+        frame.len = data;
+    else if (at == 3)
+        frame.len |= data << 8;
+    else if (at - 4 < frame.len && frame.seq == frame.expected)
+    {
+        if (frame.type == FRAME_LINE)
+        {
+            // Only from the start: the decoder may have started on a slot
+            // coming free partway through
+            if (decoder.state != DECODE_IDLE && (frame.fed || at == 4))
+            {
+                decode_byte(data);
+                frame.fed = 1;
+            }
+        }
+        else if (at - 4 < sizeof(frame.arg))
+            frame.arg[at - 4] = data;
+    }
+}
+
+static void frame_byte(uint8_t data)
+{
+    frame.empty = 0;
+    if (frame.block == 0)
+    {
+        if (frame.zero)
+            frame_put(0);
+        frame.block = data - 1;
+        frame.zero = data != 0xff;
+    }
+    else
+    {
+        frame_put(data);
+        frame.block--;
+    }
+}
+
+// Act on a frame that's arrived intact. Returns the reply.
+static uint8_t frame_act()
+{
+    switch (frame.type)
+    {
+        case FRAME_SETTING:
+            if (frame.len == SETTING_LEN && command_argument(command_for(frame.arg[0]),
+                frame.arg[1] | (uint16_t)frame.arg[2] << 8
+                | (uint32_t)frame.arg[3] << 16 | (uint32_t)frame.arg[4] << 24))
+                return 'K';
+            return 'N';
+        case FRAME_PALETTE:
+            if (busy || frame.len > sizeof(frame.arg))
+                return 'N';
+            memcpy(palette + 1, frame.arg, frame.len);
+            return 'K';
+        case FRAME_START:
+            if (busy)
+                return 'N';
+            
+            // Lines that don't fit are streamed
+            line_bytes = ((uint32_t)pixels + pack_mask) >> pack_shift;
+            stream = line_bytes > MAX_BUF;
+            start_job = 1;
+            return 'K';
+        case FRAME_LINE:
+            // It has to have been the whole line
+            if (!frame.fed || decoder.state != DECODE_DONE)
+            {
+                if (frame.fed)
+                    decode_restart();
+                return 'N';
+            }
+            ring_decoded();
+            return 'K';
+        default:
+            return 'N';
+    }
+}
+
+// The zero at the end of a frame has arrived. Returns whether it was intact.
+static uint8_t frame_end()
+{
+    // The CRC of everything including the CRC itself comes to zero
+    if (frame.count != frame.len + FRAME_OVERHEAD || frame.block || frame.crc)
+    {
+        if (frame.fed)
+            decode_restart();
+        
+        // Only the first: the frames after it that were already on the way
+        // will be sent again anyway
+        if (frame.damaged != frame.expected)
+        {
+            send_reply('R', frame.expected);
+            frame.asked = clock_now();
+        }
+        frame.damaged = frame.expected;
+        return 0;
+    }
+    
+    if (frame.seq != frame.expected)
+    {
+        // One already taken, or one after a damaged or lost one
+        uint8_t behind = (frame.expected - frame.seq) & (FRAME_SEQS - 1);
+        if (frame.seq >= FRAME_SEQS)
+            return 1;
+        if (behind < FRAME_SEQS / 2)
+        {
+            send_reply('K', frame.expected - 1);
+            return 1;
+        }
+        
+        // The one expected went missing, or so did the last one sent again
+        // in its place: ask for it again. Not for each of the frames that
+        // were already on their way when the sender last went back. The
+        // clock stands still between jobs, when frames go one at a time.
+        uint32_t now = clock_now();
+        if (!busy || now - frame.asked >= RESEND_TICKS)
+        {
+            send_reply('R', frame.expected);
+            frame.asked = now;
+        }
+        return 1;
+    }
+    
+    uint8_t reply = frame_act();
+    if (reply == 'K')
+        frame.expected = (frame.expected + 1) & (FRAME_SEQS - 1);
+    frame.damaged = FRAME_SEQS;
+    send_reply(reply, frame.seq);
+    
+    if (frame.baud)
+    {
+        serial_set_baud(frame.baud);
+        frame.baud = 0;
+    }
+    return 1;
+}
+
+// Hand an incoming byte to the frame decoder or the command parser. Frames
+// start and end with a zero; more zeros in between frames don't matter. A
+// damaged frame may have started at the end of the one before, so its
+// closing zero is taken as the start of another, to get back in step.
+static void receive_byte(uint8_t data)
+{
+    if (data == 0)
+    {
+        if (frame.state == FRAME_INSIDE && !frame.empty && frame_end())
+            frame.state = FRAME_OUTSIDE;
+        else
+            frame_begin();
+    }
+    else if (frame.state == FRAME_INSIDE)
+        frame_byte(data);
+    else
+        parse_byte(data);
+}
+
+// Deal with whatever has arrived over the serial port, or if nothing has,
+// sleep until an interrupt comes along. Everything that waits does it
+// through here.
+void idle()
+{
+    if (stream)
+        stream_release();
+    
+    uint8_t data[16];
+    uint8_t len, i;
+    uint8_t received = 0;
+    while ((len = serial_receive_block(data, sizeof(data))) != 0)
+    {
+        for (i = 0; i < len; i++)
+            receive_byte(data[i]);
+        received = 1;
+    }
+    
+    // Nothing can slip in between checking and sleeping: the instruction
+    // after sei() always runs before any interrupt
+    cli();
+    if (!received && !events && !serial_available())
+    {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    events = 0;
+    sei();
+}
+
+// The first step of a line that lands on pixel p or after it
+uint32_t step_for_pixel(uint16_t p)
+{
+    uint32_t remainder;
+    uint32_t step = longmuldiv(p, image_x, pixels, &remainder);
+    return remainder ? step + 1 : step;
+}
+
+// Where the head has to start from to laser steps first to last - 1 of a
+// line. Step x is lasered between ramp + x and ramp + x + 1.
+int32_t line_start(uint32_t first, uint32_t last, uint8_t reverse, uint16_t ramp)
+{
+    if (reverse)
+        return (int32_t)last + 2 * ramp;
+    return first;
+}
+
+// Steps left of a line when the slow-down after it gets queued, if the next
+// line hasn't turned up yet: plenty of time to plan the turnaround
+#define TURN_MARGIN 64
+
+void begin_lasering()
+{
+    busy = 1;
+    job_line = 0;
+    clock_start();
+    memset((void *)&telemetry, 0, sizeof(telemetry));
+    telemetry.start = telemetry.line_end = telemetry.stopped = clock_now();
+#if ISR_STATS
+    isr_stats_clear();
+#endif
+    
+    // Enable stepper motors
+    stepper_enable();
+    delay(100);
+    
+    // Positive Y direction
+    PORTD |= _BV(PORTD6);
+
+    // Split the scanline buffer into as many lines as fit, so that the next
+    // ones can arrive while the current one is being lasered. If only one
+    // fits, the next can't start arriving until it's been lasered.
+    ring.slots = line_bytes && !stream ? MAX_BUF / line_bytes : LINE_SLOTS;
+    if (ring.slots > LINE_SLOTS)
+        ring.slots = LINE_SLOTS;
+    uint8_t buffered = ring.slots > 1;
+    
+    // Length of the speed-up and slow-down either side of a line:
+    // accel(velocity, reverse, ramp - 1) moves ramp steps. There aren't any
+    // if the laser stays on while speeding up and slowing down.
+    uint16_t ramp = 0;
+    if (!ramp_lasering)
+    {
+        ramp = accel_steps(velocity) - 1;
+        if (ramp < ramp_steps)
+            ramp = ramp_steps;
+        ramp++;
+    }
+    state.xpos = 0;
+    
+    // Worked out here rather than between moves
+    y_cmd.ramp = accel_entries(y_velocity);
+    y_cmd.curve = curve_for(y_cmd.ramp);
+    y_cmd.ramp_steps = curve_steps(y_cmd.ramp, y_cmd.curve);
+    
+    // The first line's "previous line" is blank
+    memset(scanline, 0, sizeof(scanline));
+    ring.head = 0;
+    ring.used = 0;
+    ring.waiting = 0;
+    stream_write = 0;
+    stream_commit = 0;
+    stream_read = 0;
+    underrun = 0;
+    decoder.line_left = 0;
+    decoder.state = DECODE_IDLE;
+    ring_next();
+    send_window();
+    
+    // Blank lines aren't traversed, so the direction doesn't just follow the line number
+    uint8_t reverse = 0;
+    uint16_t line, lines;
+    for (line = 0; line < image_y; line += lines, job_line = line)
+    {
+        // The last line's slot is free once it's been lasered
+        if (buffered && line)
+        {
+            raster_wait();
+            if (underrun)
+                break;
+            ring_free();
+        }
+        
+        // Wait for this line's image data
+        uint32_t wanted = clock_now();
+        uint8_t current = ring_take();
+        uint8_t *buf = scanline;
+        uint16_t base = 0;
+        if (stream)
+            base = ring.line[current].start - (ring.line[current].first >> pack_shift);
+        else
+            buf += current * line_bytes;
+        lines = ring.line[current].lines;
+        uint32_t first = step_for_pixel(ring.line[current].first);
+        uint32_t last = step_for_pixel(ring.line[current].end);
+        
+        // Blank lines (or ones where no step lands on an inked pixel): one Y
+        // move past all of them
+        if (first == last)
+        {
+            line_arrived(wanted);
+            cli();
+            telemetry.lines_done += lines;
+            sei();
+            y_advance((uint32_t)lines * y_steps_per_scanline);
+            if (!buffered && line + lines < image_y)
+                ring_free();
+            continue;
+        }
+        
+        // Streaming: let the ring fill up first, unless the whole line's in
+        while (stream && decoder.line_left && !ring.waiting
+            && stream_free() >= STREAM_CHUNK)
+            idle();
+        line_arrived(wanted);
+        
+        // Only the span gets traversed. If the head's short of where this
+        // line's ramp starts, the ramp just starts early; if it's past it,
+        // go back for it.
+        int32_t start = line_start(first, last, reverse, ramp);
+        int32_t lead = reverse ? state.xpos - start : start - state.xpos;
+        if (lead < 0)
+        {
+            x_direction(!reverse);
+            x_travel(-lead);
+            lead = 0;
+        }
+        
+        // Lasering from a standstill: get to the start of the line, laser
+        // it and step Y+ once stopped
+        if (ramp_lasering)
+        {
+            x_direction(reverse);
+            x_travel(lead);
+            y_wait();
+            raster_move(velocity, first, last, buf, base, reverse,
+                y_steps_per_scanline, 1);
+            if (!stream)
+                reverse ^= 1;
+            if (!buffered && line + lines < image_y)
+            {
+                raster_wait();
+                ring_free();
+            }
+            continue;
+        }
+        
+        y_wait();
+        x_direction(reverse);
+        
+        // Speed up, laser the line and then step Y+ while slowing down
+        accel(velocity, 0, ramp - 1 + lead);
+        raster_move(velocity, first, last, buf, base, reverse, y_steps_per_scanline, 0);
+        
+        // Give the next line as long as possible to turn up before planning
+        // the turnaround, but get the slow-down queued before the line ends
+        while (buffered && !ring.waiting
+            && line + 1 < image_y && raster_left() > TURN_MARGIN)
+            idle();
+        
+        // Turning around: if the next line starts further on than this one
+        // stops, carry on to it before slowing down
+        uint32_t over = 0;
+        uint8_t next_slot = current + 1 < ring.slots ? current + 1 : 0;
+        if (buffered && ring.waiting && line + 1 < image_y
+            && ring.line[next_slot].first != ring.line[next_slot].end)
+        {
+            int32_t next = line_start(step_for_pixel(ring.line[next_slot].first),
+                step_for_pixel(ring.line[next_slot].end), !reverse && !stream, ramp);
+            int32_t stop = reverse ? state.xpos - ramp : state.xpos + ramp;
+            int32_t beyond = reverse ? stop - next : next - stop;
+            if (beyond > 0)
+                over = beyond;
+        }
+        accel(velocity, 1, ramp - 1 + over); // slow down
+        if (!stream)
+            reverse ^= 1;
+        
+        if (!buffered && line + lines < image_y)
+        {
+            raster_wait();
+            ring_free();
+        }
+    }
+
+    wait_for_move();
+    y_wait();
+    telemetry.finished = clock_now();
+    clock_stop();
+    stepper_disable();
+    if (stream)
+        stream_release();   // in case the last line ran out
+    stream = 0;
+    decoder.state = DECODE_IDLE;
+    busy = 0;
+}
+
 int main()
 {
     setup();
@@ -540,12 +2353,21 @@ int main()
     backlash_comp = 0;
     ramp_steps = 1000;
     velocity = 1000;
+    y_velocity = 2000;
+    ramp_lasering = 0;
     pixels = 0;
     image_x = 0;
     image_y = 0;
+    set_depth(8);
+    frame.damaged = FRAME_SEQS;
     
     while (1) {
-        main_loop();
+        idle();
+        if (start_job)
+        {
+            start_job = 0;
+            begin_lasering();
+        }
     }
 
     return 0;
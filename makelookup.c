@@ -3,44 +3,90 @@
 #include <stdlib.h>
 #include <math.h>
 
+static void write_entry(FILE *outfile, int64_t value)
+{
+    uint8_t temp;
+    // The firmware's step delays are 16 bits
+    if (value > 0xffff)
+        value = 0xffff;
+    temp = value & 0xff;
+    fwrite(&temp, 1, 1, outfile);
+    temp = (value >> 8) & 0xff;
+    fwrite(&temp, 1, 1, outfile);
+}
+
 int main(int argc, char **argv)
 {
     int running = 1;
-    int steps, total_steps;
+    int steps, total_steps, jerk_steps;
 	int64_t c, d, n, t1, t2;
-	FILE *outfile;
+	FILE *outfile, *speedfile;
 
     if (argc < 3) {
-        printf("usage: %s steps acceleration\n", argv[0]);
+        printf("usage: %s steps acceleration [jerk-steps]\n", argv[0]);
         exit(1);
     }
 
     total_steps = atoi(argv[1]);
     c = atoi(argv[2]);
+    jerk_steps = argc > 3 ? atoi(argv[3]) : 1;
+    if (jerk_steps < 1)
+        jerk_steps = 1;
     t1 = 0;
     t2 = 0;
     n = 0;
- 
+    
+    // S-curve: rather than starting with full acceleration, build it up
+    // steadily (constant jerk) over the first jerk_steps steps. Distance
+    // then goes as the cube of time: s = jerk_steps * (t / tj)^3, reaching
+    // full acceleration a at time tj, where a * tj^2 / 6 = jerk_steps.
+    // Carrying on at constant acceleration from there: s = jerk_steps +
+    // vj * t' + a * t'^2 / 2, with vj = a * tj / 2. Without the build-up
+    // it's just s = a * t^2 / 2, i.e. t = sqrt(s * c).
+    double a = 2.0 / c;
+    double tj = sqrt(6.0 * jerk_steps / a);
+    double vj = a * tj / 2;
     outfile = fopen("lookup.bin", "w");
+    speedfile = fopen("speed.bin", "w");
     for (steps = 0; steps < total_steps; steps++)
     {
-        uint8_t temp;
         n += c; 
         t2 = t1;
-        t1 = sqrt(n); 
+        if (jerk_steps == 1)
+            t1 = sqrt(n); 
+        else if (steps + 1 <= jerk_steps)
+            t1 = tj * cbrt((steps + 1.0) / jerk_steps);
+        else
+            t1 = tj + (sqrt(vj * vj + 2 * a * (steps + 1 - jerk_steps)) - vj) / a;
         d = t1 - t2; 
 #if 0
         printf("%d.\tn=%" PRIu64 " t1=%" PRIu64" t2=%" PRIu64 " d=%" PRIu64 "\n", 
                 steps, n, t1, t2, d);
 #endif
-        temp = d & 0xff;
-        fwrite(&temp, 1, 1, outfile);
-        temp = (d >> 8) & 0xff;
-        fwrite(&temp, 1, 1, outfile);
+        write_entry(outfile, d);
+        
+        // Speed for each entry, (1 << 22) / delay, so that the firmware can
+        // scale the laser power to it without dividing
+        write_entry(speedfile, d ? ((1 << 22) + d / 2) / d : 0xffff);
     }
     fclose(outfile);
+    fclose(speedfile);
     printf("Generated acceleration to rate %" PRIu64 
         " (%.1f steps per second) in %d steps.\n",
         d, 2000000.0 / d, steps);
+    
+    // The other end of the S-curve depends on the top speed, so the
+    // firmware does it: over the last jerk_steps steps of a speed-up it
+    // tails off how far along the table it gets each step, from a whole
+    // entry down to nothing, so the acceleration dies away steadily instead
+    // of cutting out. This is how far short of the top entry each of those
+    // steps is, counting back from the last.
+    outfile = fopen("jerk.bin", "w");
+    for (steps = 0; steps < jerk_steps; steps++)
+        write_entry(outfile, (int64_t)steps * (steps + 1) / (2 * jerk_steps));
+    fclose(outfile);
+    if (jerk_steps > 1)
+        printf("Acceleration builds up over %d steps (%.1f ms) and tails off "
+            "over %d.\n", jerk_steps, tj / 2000.0, jerk_steps);
     return 0;
 }
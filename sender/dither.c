@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "dither.h"
+
+// How far error diffusion spreads: one entry for each pixel it goes to,
+// right of the current one on the same line or anywhere on the two below
+typedef struct {
+    int dx, dy, weight;
+} spread_t;
+
+static const spread_t floyd[] = {
+    { 1, 0, 7 },
+    { -1, 1, 3 }, { 0, 1, 5 }, { 1, 1, 1 },
+    { 0, 0, 0 }
+};
+
+static const spread_t jarvis[] = {
+    { 1, 0, 7 }, { 2, 0, 5 },
+    { -2, 1, 3 }, { -1, 1, 5 }, { 0, 1, 7 }, { 1, 1, 5 }, { 2, 1, 3 },
+    { -2, 2, 1 }, { -1, 2, 3 }, { 0, 2, 5 }, { 1, 2, 3 }, { 2, 2, 1 },
+    { 0, 0, 0 }
+};
+
+// Only 6/8 of the error goes anywhere, which keeps highlights and shadows
+// clean at the expense of some detail
+static const spread_t atkinson[] = {
+    { 1, 0, 1 }, { 2, 0, 1 },
+    { -1, 1, 1 }, { 0, 1, 1 }, { 1, 1, 1 },
+    { 0, 2, 1 },
+    { 0, 0, 0 }
+};
+
+static const uint8_t bayer[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+// Error diffusion can't spread further than this either side
+#define REACH 2
+
+// Error rows, for the lines under way and the two below the last of them.
+// Any more lines than that wait for the oldest to finish.
+#define ERROR_ROWS 18
+
+static int width;
+static int method, top, step;
+static const spread_t *spread;
+static int divisor;
+
+// How many pixels of each line are done, from the left. Error diffusion on
+// a line keeps far enough behind the line above that it only ever sees
+// finished error, and the two never add to the same pixel at once.
+static atomic_int *progress;
+
+// Accumulated error for each line being worked on, times divisor, with
+// REACH pixels spare either side
+static int *errors;
+
+static int *error_row(int i)
+{
+    return errors + (i % ERROR_ROWS) * (width + 2 * REACH) + REACH;
+}
+
+// Nearest level to a laser power, clamped to the ones there are
+static inline int nearest_level(int power)
+{
+    int level = (power * top + 127) / 255;
+    if (level < 0)
+        return 0;
+    if (level > top)
+        return top;
+    return level;
+}
+
+static void diffuse_line(int i, uint8_t *data)
+{
+    int *err = error_row(i);
+    int ahead = i ? 0 : width;
+    int x;
+
+    // Start the error row two below afresh, once the line that last used
+    // it has finished with it. The lines below this one don't start until
+    // this one's under way.
+    if (i + 2 - ERROR_ROWS >= 0)
+    {
+        while (atomic_load_explicit(&progress[i + 2 - ERROR_ROWS],
+            memory_order_acquire) < width)
+            sched_yield();
+    }
+    memset(error_row(i + 2) - REACH, 0, (width + 2 * REACH) * sizeof(int));
+
+    for (x = 0; x < width; x++)
+    {
+        // Keep 2 * REACH + 1 behind the line above: by then it's done adding
+        // to this line up to where it's reached, and won't add to the line
+        // below anywhere this one's about to
+        int need = x + 2 * REACH + 1;
+        if (need > width)
+            need = width;
+        while (ahead < need)
+        {
+            ahead = atomic_load_explicit(&progress[i - 1], memory_order_acquire);
+            if (ahead < need)
+                sched_yield();
+        }
+
+        int power = 255 - data[x] + err[x] / divisor;
+        int level = nearest_level(power);
+        int error = power - level * step;
+        data[x] = 255 - level * step;
+
+        const spread_t *s;
+        for (s = spread; s->weight; s++)
+            error_row(i + s->dy)[x + s->dx] += error * s->weight;
+
+        if ((x & 31) == 31)
+            atomic_store_explicit(&progress[i], x + 1, memory_order_release);
+    }
+    atomic_store_explicit(&progress[i], width, memory_order_release);
+}
+
+// Ordered dither: 8 pixels at a time, each compared with its own threshold.
+// Level = power * top / 255, rounded up where the remainder's over the
+// threshold; x / 255 is (x + 1 + (x >> 8)) >> 8 for anything this can be.
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+typedef uint8_t v8u8 __attribute__((vector_size(8)));
+
+static void ordered_line(int i, uint8_t *data)
+{
+    const uint8_t *row = bayer[i & 7];
+    v8u16 threshold;
+    int x;
+
+    // Thresholds spread evenly between 0 and 255
+    for (x = 0; x < 8; x++)
+        threshold[x] = (row[x] * 2 + 1) * 255 / 128;
+
+    for (x = 0; x + 8 <= width; x += 8)
+    {
+        v8u8 grey;
+        memcpy(&grey, data + x, 8);
+        v8u16 scaled = (255 - __builtin_convertvector(grey, v8u16)) * (uint16_t)top;
+        v8u16 level = (scaled + 1 + (scaled >> 8)) >> 8;
+        v8u16 over = (v8u16)(scaled - level * 255 > threshold);
+        level -= over;      // true is all ones, i.e. -1
+        grey = __builtin_convertvector(255 - level * (uint16_t)step, v8u8);
+        memcpy(data + x, &grey, 8);
+    }
+    for (; x < width; x++)
+    {
+        int scaled = (255 - data[x]) * top;
+        int level = scaled / 255 + (scaled % 255 > threshold[x & 7]);
+        data[x] = 255 - level * step;
+    }
+}
+
+void dither_init(int method_in, int width_in, int height, int levels)
+{
+    method = method_in;
+    width = width_in;
+    top = levels - 1;
+    step = 255 / top;
+
+    if (method == DITHER_FLOYD)
+    {
+        spread = floyd;
+        divisor = 16;
+    }
+    else if (method == DITHER_JARVIS)
+    {
+        spread = jarvis;
+        divisor = 48;
+    }
+    else
+    {
+        spread = atkinson;
+        divisor = 8;
+    }
+
+    progress = calloc(height, sizeof(atomic_int));
+    errors = calloc(ERROR_ROWS * (width + 2 * REACH), sizeof(int));
+}
+
+void dither_line(int i, uint8_t *data)
+{
+    if (method == DITHER_BAYER)
+        ordered_line(i, data);
+    else
+        diffuse_line(i, data);
+}
@@ -0,0 +1,22 @@
+#ifndef __DITHER_H
+#define __DITHER_H
+
+#include <stdint.h>
+
+#define DITHER_NONE 0
+#define DITHER_FLOYD 1      // Floyd-Steinberg error diffusion
+#define DITHER_JARVIS 2     // Jarvis, Judice and Ninke error diffusion
+#define DITHER_ATKINSON 3   // Atkinson error diffusion
+#define DITHER_BAYER 4      // 8x8 Bayer ordered dither
+
+// Set up for dithering lines width pixels long, for an image height lines
+// high, to the given number of evenly spread levels of laser power. Each
+// grey level left in them is one of those levels exactly.
+void dither_init(int method, int width, int height, int levels);
+
+// Dither line i, counting from the top, in place. Any number of lines can
+// be under way at once on different threads: with error diffusion, each
+// waits for the one above to get far enough ahead.
+void dither_line(int i, uint8_t *data);
+
+#endif
@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "estimate.h"
+
+// Everything's timed in the controller's step timer ticks: 2MHz
+#define TICKS_PER_SECOND 2000000.0
+
+// The Y axis timer's ticks are 32 of those
+#define Y_TICK_SHIFT 5
+
+// As in the firmware
+#define MAX_BUF 1500
+#define LINE_SLOTS 8
+#define STREAM_BYTES 1024
+#define STREAM_CHUNK 128
+
+// How far ahead of the laser a streamed line's data can get, at most: the
+// ring, less the chunk being lasered and the one whose credit is on its way
+#define STREAM_AHEAD (STREAM_BYTES - 2 * STREAM_CHUNK)
+
+static uint16_t *lookup, *jerk;
+static int lookup_entries, jerk_entries;
+
+static job_t job;
+static int slots, ramp;
+static int y_ramp, y_curve, y_ramp_steps;
+
+// Where things stand: the head's position and direction, when each axis
+// finishes what it's been given, when the link is free, and when each of
+// the controller's line slots was last given back
+static int32_t xpos;
+static int reverse;
+static int64_t x_free, y_free, link_free, raster_end;
+static int64_t slot_free[LINE_SLOTS];
+static int64_t first_start;     // when the first lasered line's laser comes on
+static long frames;
+
+// Lines as they come in: the one being collected (a streamed one comes in
+// pieces), and the one before it, which needs its span to plan the
+// turnaround after it
+typedef struct {
+    int lines, first, end;
+    long bytes;
+} span_t;
+static span_t held, incoming;
+static int have_held, have_incoming;
+static int line_no;
+
+// What held the lines up
+#define LIMIT_X 0
+#define LIMIT_Y 1
+#define LIMIT_LINK 2
+static const char *limit_names[] = { "X axis", "Y axis", "serial link" };
+static long limited[3];
+static int underruns;
+
+static uint16_t *load_table(const char *filename, int *entries)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return NULL;
+    uint16_t *table = NULL;
+    uint8_t pair[2];
+    int n = 0;
+    while (fread(pair, 1, 2, file) == 2)
+    {
+        table = realloc(table, (n + 1) * sizeof(uint16_t));
+        table[n++] = pair[0] | pair[1] << 8;
+    }
+    fclose(file);
+    *entries = n;
+    return table;
+}
+
+int estimate_tables(const char *lookup_file)
+{
+    lookup = load_table(lookup_file, &lookup_entries);
+
+    // jerk.bin is written into the same directory
+    char jerk_file[strlen(lookup_file) + 16];
+    strcpy(jerk_file, lookup_file);
+    char *slash = strrchr(jerk_file, '/');
+    strcpy(slash ? slash + 1 : jerk_file, "jerk.bin");
+    jerk = load_table(jerk_file, &jerk_entries);
+
+    return lookup_entries && jerk_entries;
+}
+
+// The same as the firmware's, which take the same time step for step
+
+static uint16_t lookup_delay(int table_entry)
+{
+    if (table_entry >= lookup_entries)
+        table_entry = lookup_entries - 1;
+    return lookup[table_entry];
+}
+
+static uint16_t curve_entry(uint16_t k, uint16_t steps, uint16_t top, uint16_t curve)
+{
+    uint16_t from_end = steps - 1 - k;
+    if (from_end < curve)
+        return top - jerk[from_end];
+    return k;
+}
+
+static uint16_t accel_entries(uint16_t rate)
+{
+    int table_entry;
+    for (table_entry = 0; table_entry < lookup_entries; table_entry++)
+    {
+        if (lookup[table_entry] < rate)
+            break;
+    }
+    return table_entry;
+}
+
+static uint16_t curve_for(uint16_t table_entry)
+{
+    uint16_t curve = jerk_entries;
+    if (curve > table_entry + 1)
+        curve = table_entry + 1;
+    while (curve > 1 && jerk[curve - 1] > table_entry)
+        curve--;
+    return curve;
+}
+
+static uint16_t curve_steps(uint16_t table_entry, uint16_t curve)
+{
+    return table_entry + curve - jerk[curve - 1];
+}
+
+// The step timer clears on reaching the delay, so each step takes one more
+// tick than it
+static int64_t flat_time(uint16_t rate, uint32_t steps)
+{
+    return (int64_t)steps * (rate + 1);
+}
+
+static int64_t table_time(uint16_t table_entry, int slowing, uint16_t *steps_out)
+{
+    uint16_t curve = curve_for(table_entry);
+    uint16_t steps = curve_steps(table_entry, curve);
+    int64_t time;
+    int k;
+
+    if (!slowing)
+    {
+        time = lookup_delay(0) + 1;
+        for (k = 1; k < steps; k++)
+            time += lookup_delay(curve_entry(k, steps, table_entry, curve)) + 1;
+    }
+    else
+    {
+        time = lookup_delay(steps > 1 ? curve_entry(steps - 2, steps, table_entry, curve) : 0) + 1;
+        for (k = steps - 2; k >= 0; k--)
+            time += lookup_delay(curve_entry(k, steps, table_entry, curve)) + 1;
+    }
+    *steps_out = steps;
+    return time;
+}
+
+// Up to speed and padded out to pad_steps + 1 steps, or the other way round
+static int64_t accel_time(uint16_t rate, int slowing, uint32_t pad_steps)
+{
+    uint16_t steps;
+    int64_t time = table_time(accel_entries(rate), slowing, &steps);
+    if (steps <= pad_steps)
+        time += flat_time(rate, pad_steps + 1 - steps);
+    return time;
+}
+
+static int64_t travel_time(uint32_t steps)
+{
+    uint16_t ramp_steps;
+    if (steps < 2)
+        return flat_time(lookup_delay(0), steps);
+
+    int table_entry = accel_entries(job.velocity);
+    if (table_entry > steps / 2 - 1)
+        table_entry = steps / 2 - 1;
+    uint16_t ramp = curve_steps(table_entry, curve_for(table_entry));
+    while (ramp > steps / 2)
+    {
+        table_entry--;
+        ramp = curve_steps(table_entry, curve_for(table_entry));
+    }
+    return table_time(table_entry, 0, &ramp_steps)
+        + flat_time(lookup_delay(table_entry), steps - 2 * ramp)
+        + table_time(table_entry, 1, &ramp_steps);
+}
+
+// A raster move lasering while it speeds up and slows down: the same steps
+// either way round. Split into several moves if it's long, it only speeds
+// up at the start of the first and slows down at the end of the last.
+static int64_t ramped_raster_time(uint16_t rate, uint32_t steps)
+{
+    uint16_t top = accel_entries(rate);
+    if (top)
+        top--;
+    uint16_t curve = curve_for(top);
+    uint16_t ramp_steps = curve_steps(top, curve);
+    int64_t time = 0;
+    uint32_t i;
+    for (i = 0; i < steps; i++)
+    {
+        uint32_t k = steps - 1 - i < i ? steps - 1 - i : i;
+        if (k + 1 >= ramp_steps)
+            time += rate + 1;
+        else
+            time += lookup_delay(curve_entry(k, ramp_steps, top, curve)) + 1;
+    }
+    return time;
+}
+
+static int64_t y_step_time(uint16_t table_entry)
+{
+    uint16_t step_delay = lookup_delay(table_entry) >> Y_TICK_SHIFT;
+    if (step_delay > 256)
+        step_delay = 256;
+    if (step_delay < 2)
+        step_delay = 2;
+    return (int64_t)step_delay << Y_TICK_SHIFT;
+}
+
+static int64_t y_time(uint32_t steps)
+{
+    int64_t time = 0;
+    while (steps)
+    {
+        uint16_t move = steps > 0xffff ? 0xffff : steps;
+        int s;
+        time += y_step_time(0);
+        for (s = 1; s < move; s++)
+        {
+            int k = move - 1 - s < s ? move - 1 - s : s;
+            if (k + 1 >= y_ramp_steps)
+                time += y_step_time(y_ramp);
+            else
+                time += y_step_time(curve_entry(k, y_ramp_steps, y_ramp, y_curve));
+        }
+        steps -= move;
+    }
+    return time;
+}
+
+static uint32_t step_for_pixel(uint16_t p)
+{
+    return ((uint64_t)p * job.steps + job.pixels - 1) / job.pixels;
+}
+
+static int32_t line_start(uint32_t first, uint32_t last, int reverse)
+{
+    if (reverse)
+        return (int32_t)last + 2 * ramp;
+    return first;
+}
+
+// Where the head will be after steps in the given direction
+static void x_moved(int backwards, int32_t steps)
+{
+    xpos += backwards ? -steps : steps;
+}
+
+void estimate_start(const job_t *settings)
+{
+    job = *settings;
+
+    int line_bytes = ((long)job.pixels * job.depth + 7) / 8;
+    slots = job.stream ? LINE_SLOTS : MAX_BUF / line_bytes;
+    if (slots > LINE_SLOTS)
+        slots = LINE_SLOTS;
+
+    ramp = 0;
+    if (!job.ramp_lasering)
+    {
+        ramp = curve_steps(accel_entries(job.velocity), curve_for(accel_entries(job.velocity))) - 1;
+        if (ramp < job.ramp_steps)
+            ramp = job.ramp_steps;
+        ramp++;
+    }
+    y_ramp = accel_entries(job.y_velocity);
+    y_curve = curve_for(y_ramp);
+    y_ramp_steps = curve_steps(y_ramp, y_curve);
+
+    // The controller waits 100ms for the motors to be enabled
+    xpos = 0;
+    reverse = 0;
+    x_free = y_free = raster_end = 0.1 * TICKS_PER_SECOND;
+    link_free = 0;
+    memset(slot_free, 0, sizeof(slot_free));
+    first_start = -1;
+    frames = 0;
+    line_no = 0;
+    have_held = have_incoming = 0;
+    memset(limited, 0, sizeof(limited));
+    underruns = 0;
+}
+
+static int64_t bytes_time(long bytes)
+{
+    return (int64_t)(bytes * 10 * TICKS_PER_SECOND / job.baud);
+}
+
+static int64_t max64(int64_t a, int64_t b)
+{
+    return a > b ? a : b;
+}
+
+// Lines are taken the way the controller's main loop takes them, and timed
+// from the end of the line before to the end of this one
+static void take_line(const span_t *line, const span_t *next)
+{
+    // The link: a frame can't be sent until there's a slot for it, or when
+    // streaming, until the line before has started to make room
+    int64_t *slot = &slot_free[frames++ % slots];
+    int64_t sent = max64(link_free, job.stream ? raster_end : *slot);
+    int64_t ready = sent + bytes_time(job.stream && line->bytes > STREAM_BYTES
+        ? STREAM_BYTES : line->bytes);
+    int64_t arrived = sent + bytes_time(line->bytes);
+
+    // The main loop gets to it once the line before is lasered and it's
+    // here (streaming, as much of it as there's room for)
+    int64_t before = raster_end;
+    int64_t reached = max64(raster_end, ready);
+
+    uint32_t first = step_for_pixel(line->first);
+    uint32_t last = step_for_pixel(line->end);
+    if (first == last)
+    {
+        // One Y move past all of them
+        y_free = max64(y_free, reached) + y_time((uint32_t)line->lines * job.y_steps);
+        *slot = reached;
+        link_free = arrived;
+        printf("Raster lines %d-%d (blank): %.1f ms\n", line_no, line_no + line->lines - 1,
+            (y_free - before) / TICKS_PER_SECOND * 1000);
+        return;
+    }
+
+    // Back for it first if the head's already past where it starts
+    int32_t start = line_start(first, last, reverse);
+    int32_t lead = reverse ? xpos - start : start - xpos;
+    if (lead < 0)
+    {
+        x_free = max64(x_free, reached) + travel_time(-lead);
+        x_moved(!reverse, -lead);
+        lead = 0;
+    }
+
+    // Lasering starts once the Y axis has stepped on and the X axis has
+    // finished slowing down from the line before, and the data's here
+    uint32_t steps = last - first;
+    int64_t begin, lasering, slow = 0;
+    if (job.ramp_lasering)
+    {
+        x_free = max64(x_free, reached) + travel_time(lead);
+        x_moved(reverse, lead);
+        begin = max64(max64(x_free, y_free), reached);
+        lasering = ramped_raster_time(job.velocity, steps);
+        raster_end = begin + lasering;
+        x_moved(reverse, steps);
+    }
+    else
+    {
+        begin = max64(max64(x_free, y_free), reached);
+        lasering = flat_time(job.velocity, steps);
+        raster_end = begin + accel_time(job.velocity, 0, ramp - 1 + lead) + lasering;
+        x_moved(reverse, lead + ramp + steps);
+
+        // Carrying on to the next line before slowing down if it starts
+        // further on than this one stops
+        uint32_t over = 0;
+        if (next && slots > 1)
+        {
+            uint32_t next_first = step_for_pixel(next->first);
+            uint32_t next_last = step_for_pixel(next->end);
+            if (next_first != next_last)
+            {
+                int32_t to = line_start(next_first, next_last, !reverse && !job.stream);
+                int32_t stop = reverse ? xpos - ramp : xpos + ramp;
+                int32_t beyond = reverse ? stop - to : to - stop;
+                if (beyond > 0)
+                    over = beyond;
+            }
+        }
+        slow = accel_time(job.velocity, 1, ramp - 1 + over);
+        x_moved(reverse, ramp + over);
+    }
+    
+    if (first_start < 0)
+        first_start = raster_end - lasering;
+    
+    int limit = begin == reached && reached > x_free && reached > y_free ? LIMIT_LINK
+        : begin == y_free && y_free > x_free ? LIMIT_Y : LIMIT_X;
+    limited[limit] += line->lines;
+
+    // Y steps on as soon as the line's lasered
+    y_free = raster_end + y_time(job.y_steps);
+    x_free = raster_end + slow;
+    *slot = raster_end;
+
+    // Streaming, the data after the first ring's worth only arrives as the
+    // laser makes room for it, and the laser mustn't catch up with it
+    const char *warning = "";
+    if (job.stream && line->bytes > STREAM_AHEAD)
+        arrived = max64(arrived, raster_end - lasering + bytes_time(line->bytes - STREAM_AHEAD));
+    link_free = arrived;
+    if (job.stream && arrived > raster_end)
+    {
+        underruns++;
+        warning = " (it would run out of data)";
+    }
+
+    printf("Raster line %d: %.1f ms, waiting on the %s%s\n", line_no,
+        (raster_end - before) / TICKS_PER_SECOND * 1000, limit_names[limit], warning);
+    if (!job.stream)
+        reverse ^= 1;
+}
+
+// The line before the one that's just finished coming in can go
+static void line_in()
+{
+    if (have_held)
+    {
+        take_line(&held, &incoming);
+        line_no += held.lines;
+    }
+    held = incoming;
+    have_held = 1;
+    have_incoming = 0;
+}
+
+void estimate_frame(int lines, int first, int end, int bytes)
+{
+    if (!lines)
+    {
+        incoming.bytes += bytes;
+        return;
+    }
+    if (have_incoming)
+        line_in();
+    incoming.lines = lines;
+    incoming.first = first;
+    incoming.end = end;
+    incoming.bytes = bytes;
+    have_incoming = 1;
+}
+
+static void show_time(const char *what, double seconds)
+{
+    int s = (int)(seconds + 0.5);
+    printf("%s%d:%02d:%02d (%.1f s)\n", what, s / 3600, s / 60 % 60, s % 60, seconds);
+}
+
+void estimate_finish()
+{
+    if (have_incoming)
+        line_in();
+    if (have_held)
+    {
+        take_line(&held, NULL);
+        line_no += held.lines;
+    }
+
+    double seconds = max64(x_free, y_free) / TICKS_PER_SECOND;
+    long lasered = limited[LIMIT_X] + limited[LIMIT_Y] + limited[LIMIT_LINK];
+    printf("\n");
+    show_time("Predicted time: ", seconds);
+    printf("%d scanlines, %.1f ms each on average", line_no, seconds * 1000 / line_no);
+    if (lasered)
+    {
+        printf(", %.1f ms for each of the %ld lasered, from the first to the last",
+            (raster_end - first_start) / TICKS_PER_SECOND * 1000 / lasered, lasered);
+    }
+    printf("\n");
+    printf("Lines waiting on the X axis: %ld, the Y axis: %ld, the serial link: %ld\n",
+        limited[LIMIT_X], limited[LIMIT_Y], limited[LIMIT_LINK]);
+    if (underruns)
+    {
+        printf("The controller would run out of data on %d streamed lines: "
+            "try a higher baud rate or a lower velocity.\n", underruns);
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef __ESTIMATE_H
+#define __ESTIMATE_H
+
+// The job's settings, as the controller will have them
+typedef struct {
+    int pixels;         // image width
+    int steps;          // final width
+    int depth;          // bits per pixel
+    int stream;         // lines streamed through the buffer
+    int velocity;
+    int y_velocity;
+    int ramp_steps;
+    int ramp_lasering;
+    int y_steps;        // per scanline
+    int baud;
+} job_t;
+
+// Load the controller's acceleration table, lookup.bin as written by
+// makelookup, and jerk.bin from alongside it. Returns 0 if it can't.
+int estimate_tables(const char *lookup_file);
+
+void estimate_start(const job_t *job);
+
+// The next frame of line data, bytes long on the wire: lines of them (more
+// than 1 for blank ones), lasered from pixel first up to end. A streamed
+// line's pieces after the first have lines 0.
+void estimate_frame(int lines, int first, int end, int bytes);
+
+// Show how long the job would take and what held each line up
+void estimate_finish();
+
+#endif
@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <FreeImage.h>
+
+#include "image.h"
+#include "resample.h"
+#include "dither.h"
+
+#define MAX_THREADS 16
+
+// Lines resampled on their own, with no dithering, go to each thread in
+// runs of this many so that it can reuse the source lines they share
+#define RESAMPLE_RUN 16
+
+// The source image: a PGM file mapped into memory, or a FreeImage bitmap
+// that's already grey or gets turned grey a line at a time
+static const uint8_t *map;
+static const uint8_t *map_dropped;      // pages before this are out of memory
+static FIBITMAP *bitmap;
+static int colour;
+static int src_w, src_h;
+
+// The lines being made, IMAGE_RING of them from the first not yet released.
+// Without resampling or dithering they come straight from the source.
+static uint8_t *ring;
+static int width, height;
+static int resampling, dither;
+static int threads, run;
+static atomic_int *ready;
+static atomic_int released;
+
+// Lines made, and for image_line() how many were ready ahead of the one it
+// wanted and how often it had to wait for that one
+static atomic_int made;
+static long taken, made_total, waited;
+static int made_max;
+
+// Binary PGM: "P5", the width, height and biggest grey level, each after
+// some whitespace (or comments), then one more whitespace character and the
+// pixels, top line first
+static int pgm_number(const uint8_t *data, size_t size, size_t *at)
+{
+    int value = 0;
+    while (*at < size && (data[*at] == '#' || data[*at] <= ' '))
+    {
+        if (data[*at] == '#')
+        {
+            while (*at < size && data[*at] != '\n')
+                (*at)++;
+        }
+        else
+            (*at)++;
+    }
+    if (*at == size || data[*at] < '0' || data[*at] > '9')
+        return -1;
+    while (*at < size && data[*at] >= '0' && data[*at] <= '9')
+        value = value * 10 + data[(*at)++] - '0';
+    return value;
+}
+
+static int open_pgm(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 2)
+    {
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    size_t at = 2;
+    int w = -1, h = -1, max = -1;
+    if (data[0] == 'P' && data[1] == '5')
+    {
+        w = pgm_number(data, size, &at);
+        h = pgm_number(data, size, &at);
+        max = pgm_number(data, size, &at);
+    }
+    at++;
+    if (w <= 0 || h <= 0 || max != 255 || at + (size_t)w * h > size)
+    {
+        munmap((void *)data, size);
+        return 0;
+    }
+
+    // Read once, front to back
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+    map = data + at;
+    map_dropped = data;
+    src_w = w;
+    src_h = h;
+    return 1;
+}
+
+int image_open(const char *filename, int *w, int *h)
+{
+    if (!open_pgm(filename))
+    {
+        FREE_IMAGE_FORMAT fmt = FreeImage_GetFileType(filename, 0);
+        bitmap = FreeImage_Load(fmt, filename, 0);
+        if (bitmap == 0)
+            return 0;
+
+        // Grey or RGB is used as it is. Anything else is converted all at
+        // once, but then the original can go.
+        int bpp = FreeImage_GetBPP(bitmap);
+        colour = FreeImage_GetImageType(bitmap) == FIT_BITMAP && (bpp == 24 || bpp == 32);
+        if (!colour && !(bpp == 8 && FreeImage_GetColorType(bitmap) == FIC_MINISBLACK))
+        {
+            FIBITMAP *grey = FreeImage_ConvertToGreyscale(bitmap);
+            FreeImage_Unload(bitmap);
+            bitmap = grey;
+            if (bitmap == 0)
+                return 0;
+        }
+        src_w = FreeImage_GetWidth(bitmap);
+        src_h = FreeImage_GetHeight(bitmap);
+    }
+    *w = src_w;
+    *h = src_h;
+    return 1;
+}
+
+// Source line y from the top, in grey levels. buf is only needed for a
+// colour image, and the same weights as FreeImage's own greyscale.
+static const uint8_t *source_line(int y, uint8_t *buf)
+{
+    if (map)
+        return map + (size_t)y * src_w;
+    uint8_t *data = FreeImage_GetScanLine(bitmap, src_h - y - 1);
+    if (!colour)
+        return data;
+
+    int bytes = FreeImage_GetBPP(bitmap) / 8;
+    int x;
+    for (x = 0; x < src_w; x++, data += bytes)
+    {
+        buf[x] = (uint8_t)(0.2126f * data[FI_RGBA_RED] + 0.7152f * data[FI_RGBA_GREEN]
+            + 0.0722f * data[FI_RGBA_BLUE]);
+    }
+    return buf;
+}
+
+static void *image_thread(void *arg)
+{
+    resample_cache_t *cache = resampling ? resample_cache() : NULL;
+    uint8_t *buf = malloc(src_w);
+    int first, i;
+
+    for (first = (intptr_t)arg * run; first < height; first += threads * run)
+    {
+        for (i = first; i < first + run && i < height; i++)
+        {
+            // Its place in the ring has to have been finished with
+            while (i - atomic_load(&released) >= IMAGE_RING)
+                usleep(100);
+
+            uint8_t *line = ring + (size_t)(i % IMAGE_RING) * width;
+            if (cache)
+                resample_line(i, line, cache);
+            else
+                memcpy(line, source_line(i, buf), width);
+            if (dither)
+                dither_line(i, line);
+            atomic_store(&ready[i], 1);
+            atomic_fetch_add(&made, 1);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+void image_start(int w, int h, int filter, int dither_in, int levels)
+{
+    width = w;
+    height = h;
+    dither = dither_in;
+    resampling = filter != RESAMPLE_NONE && (width != src_w || height != src_h);
+    if (!resampling && !dither && !colour)
+        return;
+
+    if (resampling)
+        resample_init(src_w, src_h, width, height, filter, source_line);
+    if (dither)
+        dither_init(dither, width, height, levels);
+
+    // Error diffusion goes fastest with each line on the next thread, as
+    // the line below can follow close behind the one above
+    run = resampling && !dither ? RESAMPLE_RUN : 1;
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads < 1)
+        threads = 1;
+
+    ring = malloc((size_t)IMAGE_RING * width);
+    ready = calloc(height, sizeof(atomic_int));
+
+    intptr_t t;
+    for (t = 0; t < threads; t++)
+    {
+        pthread_t thread;
+        pthread_create(&thread, NULL, image_thread, (void *)t);
+        pthread_detach(thread);
+    }
+}
+
+const uint8_t *image_line(int i)
+{
+    if (!ring)
+        return source_line(i, NULL);
+    if (!atomic_load(&ready[i]))
+    {
+        waited++;
+        while (!atomic_load(&ready[i]))
+            usleep(100);
+    }
+
+    int ahead = atomic_load(&made) - i;
+    taken++;
+    made_total += ahead;
+    if (ahead > made_max)
+        made_max = ahead;
+    return ring + (size_t)(i % IMAGE_RING) * width;
+}
+
+void image_release(int i)
+{
+    if (i <= atomic_load(&released))
+        return;
+    atomic_store(&released, i);
+
+    // The file's pages well behind the source lines still needed can go
+    // too: if they were needed again they'd just be read back in
+    if (map)
+    {
+        long y = (long)i * src_h / height - 4 * (src_h / height + 1);
+        long page = sysconf(_SC_PAGESIZE);
+        const uint8_t *end = (const uint8_t *)((uintptr_t)(map + y * src_w) & ~(page - 1));
+        if (y > 0 && end > map_dropped)
+        {
+            madvise((void *)map_dropped, end - map_dropped, MADV_DONTNEED);
+            map_dropped = end;
+        }
+    }
+}
+
+void image_show_stats()
+{
+    if (!ring)
+        return;
+    printf("Lines made ahead: %ld taken, %.1f deep on average, %d at most, found empty %ld times\n",
+        taken, taken ? (double)made_total / taken : 0.0, made_max, waited);
+}
@@ -0,0 +1,31 @@
+#ifndef __IMAGE_H
+#define __IMAGE_H
+
+#include <stdint.h>
+
+// Lines are resampled and dithered into a ring of this many, ahead of being
+// sent, so the memory it takes doesn't depend on the height of the image
+#define IMAGE_RING 256
+
+// Open an image. Binary PGM files are mapped into memory rather than read,
+// and others are loaded with FreeImage but only turned into grey levels a
+// line at a time. Returns 0 if it can't be loaded.
+int image_open(const char *filename, int *width, int *height);
+
+// Start making the lines that'll be sent, on as many threads as there are
+// cores: resampled to width x height with the given filter, and dithered to
+// the given number of levels of laser power
+void image_start(int width, int height, int filter, int dither, int levels);
+
+// Grey levels of line i, counting from the top, once it's ready. It stays
+// valid until image_release() is called for a line after it, and lines up
+// to IMAGE_RING - 1 after the first not yet released can be waited for.
+const uint8_t *image_line(int i);
+
+// The lines before i won't be needed again
+void image_release(int i);
+
+// How far ahead of image_line() the lines were being made
+void image_show_stats();
+
+#endif
@@ -3,11 +3,30 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <libserialport.h>
 #include <FreeImage.h>
 
+#include "dither.h"
+#include "resample.h"
+#include "image.h"
+#include "queue.h"
+#include "estimate.h"
+
 const char *serial_port = "/dev/ttyUSB0";
 
+// The controller always starts out at this baud rate
+#define START_BAUD 57600
+
+// Flow control modes; see serial.h in the firmware
+#define FLOW_NONE 0
+#define FLOW_XONXOFF 1
+#define FLOW_RTSCTS 2
+
 typedef struct sp_port sp_port_t;
 typedef struct sp_port_config sp_port_config_t;
 typedef enum sp_return sp_return_t;
@@ -17,10 +36,165 @@ uint16_t y_steps_per_scanline;
 uint16_t backlash_compensation_steps;
 uint16_t ramp_steps;
 uint16_t velocity;
+uint16_t y_velocity;
+uint16_t ramp_lasering;
+int depth;
+int dither;
 int final_width;
+int final_height;
+int filter;
+int baud;
+int flow;
+const char *dry_run_lookup;     // the acceleration table, for a dry run
+double telemetry_interval;      // seconds between asking for "#T", or 0
+int byte_writes;                // a write per byte, to time against
 
 sp_port_t *port;
 
+// Scanline encodings; see main.c in the firmware
+#define LINE_RAW 'R'
+#define LINE_RLE 'L'
+#define LINE_SAME 'S'
+#define LINE_DELTA 'D'
+#define LINE_BLANK 'B'
+
+// Run-length packets: header 0..127 is followed by header + 1 literal bytes,
+// 128..255 by a single byte to be repeated header - 126 times.
+#define RLE_LITERAL_MAX 128
+#define RLE_RUN_MIN 3
+#define RLE_RUN_MAX 129
+
+// The controller's scanline buffer. Lines that don't fit are streamed
+// through it in pieces of STREAM_CHUNK bytes, and all lasered left to right.
+#define MAX_BUF 1500
+#define STREAM_CHUNK 128
+
+int stream;
+
+// Frames; see main.c in the firmware
+#define FRAME_SETTING 'P'
+#define FRAME_PALETTE 'C'
+#define FRAME_START '!'
+#define FRAME_LINE 'D'
+
+#define FRAME_SEQS 64
+#define FRAME_OVERHEAD 6
+#define FRAME_TRIES 10
+
+// How long to wait for a frame's reply, from when it was last sent
+#define REPLY_TIMEOUT 250
+
+// How long to wait for credit for more lines before asking for it again, in
+// case it got lost
+#define CREDIT_TIMEOUT 5000
+
+// How often to ask whether the job's finished once it's all been sent, in us
+#define FINISH_POLL_US 200000
+
+// seq of the next new frame
+uint8_t seq;
+
+// Credit for lines from the controller: they can be sent up to but not
+// including this seq. -1 until the first arrives.
+int window_end = -1;
+
+// Lines sent and not yet taken, oldest first. The first pending_sent of
+// them have been sent since they were last asked for again.
+#define WINDOW_MAX 32
+struct {
+    uint8_t seq;
+    int line;       // first image line
+    int lines;      // 1, or the number of blank ones
+    int size;
+    uint8_t *data;
+    uint8_t *copy;  // its power levels, to encode it again on its own
+    int sent;       // times sent
+    struct timespec sent_at;    // when it was last sent
+    int tries;      // times it's been the first one sent again
+} pending[WINDOW_MAX];
+int pending_first, pending_count, pending_sent;
+
+// Lines encoded and waiting to be sent, from encode_lines(), which sets
+// encode_done once it's put the last of them in the queue
+#define ENCODE_AHEAD 32
+struct {
+    int line;
+    int lines;
+    int first, end;     // the span, for a dry run
+    int size;
+    uint8_t *data;
+    uint8_t *copy;
+} encoded[ENCODE_AHEAD];
+queue_t encode_queue;
+atomic_int encode_done;
+
+// The controller's counters, from "#T"; see send_telemetry() in the
+// firmware. Times are in its clock ticks.
+#define CLOCK_TICK_US 128
+typedef struct {
+    int line, lines_done, lines;
+    long elapsed;
+    int line_motion, line_wait;
+    long wait, stall;
+    int stalls;
+    int rx_overruns, rx_dropped, rx_high, tx_high;
+    int busy;
+} telemetry_t;
+
+// The last that get_reply() read, and the last the main thread was given
+telemetry_t reply_telemetry, telemetry;
+
+// Replies from the controller as they come in, from read_replies()
+#define REPLIES_MAX 64
+struct {
+    int reply;
+    int seq;
+    telemetry_t telemetry;
+} replies[REPLIES_MAX];
+queue_t reply_queue;
+atomic_int replies_stop;
+pthread_t replies_thread;
+
+// Compression statistics for the report at the end
+struct {
+    long raw_bytes;
+    long sent_bytes;
+    int lines[256];
+    int resent;
+    long writes;            // calls to write to the port
+    double write_seconds;   // and the time spent in them
+} stats;
+
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Write all of data to the port in one go. Blocking, so that flow control
+// holds it up rather than bytes getting dropped, and it only takes more than
+// one call if the write is interrupted. With --byte-writes it goes a byte per
+// call instead, as frames used to.
+void serial_write(const void *data, int len)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (len > 0)
+    {
+        int result = sp_blocking_write(port, data, byte_writes ? 1 : len, 0);
+        stats.writes++;
+        if (result < 0)
+        {
+            fprintf(stderr, "Couldn't write to the serial port.\n");
+            exit(5);
+        }
+        data = (const uint8_t *)data + result;
+        len -= result;
+    }
+    stats.write_seconds += seconds_since(&start);
+}
+
 int get_response(int timeout)
 {
     sp_return_t result;
@@ -46,7 +220,7 @@ int get_response(int timeout)
 // Wait up to 200ms for handshake sequence ##
 int handshake()
 {
-    sp_nonblocking_write(port, "##", 2);
+    serial_write("##", 2);
     sp_drain(port);
 
     if (get_response(500) == '#')
@@ -69,37 +243,948 @@ void show_debug()
     printf("\n");
 }
 
-// The device should respond #Y or #N
-void wait_for_ok()
+// The same CRC as avr-libc's _crc_ccitt_update()
+uint16_t crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+    data ^= crc & 0xff;
+    data ^= data << 4;
+    return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
+        ^ ((uint16_t)data << 3));
+}
+
+// COBS-encode len bytes from src into out, returning the encoded size. out
+// needs room for len + len / 254 + 1 bytes.
+int cobs_encode(const uint8_t *src, int len, uint8_t *out)
 {
-    int response = get_response(200);
-    if (response == 0)
+    int code = 0; // index in out of the current block's code byte
+    int size = 1;
+    int i;
+    
+    for (i = 0; i < len; i++)
     {
-        fprintf(stderr, "No response from device.\n");
-        show_debug();
-        exit(5);
-    } 
-    else if (response == 'N')
+        if (src[i] == 0)
+        {
+            out[code] = size - code;
+            code = size++;
+            continue;
+        }
+        out[size++] = src[i];
+        if (size - code == 0xff)
+        {
+            out[code] = 0xff;
+            code = size++;
+        }
+    }
+    out[code] = size - code;
+    return size;
+}
+
+// One of the counters, bytes long, at *at in data
+static long counter(const uint8_t *data, int *at, int bytes)
+{
+    long value = 0;
+    int i;
+    for (i = bytes - 1; i >= 0; i--)
+        value = value << 8 | data[*at + i];
+    *at += bytes;
+    return value;
+}
+
+// "#T": the counters in hex, LSB first, up to ';'
+static int read_telemetry(telemetry_t *t)
+{
+    uint8_t data[32], c = 0;
+    int len = 0, digits = 0, at = 0;
+    memset(data, 0, sizeof(data));
+    while (sp_blocking_read(port, &c, 1, 100) == 1 && c != ';')
+    {
+        int value = c >= 'a' ? c - 'a' + 10 : c - '0';
+        if (value < 0 || value > 15)
+            return 0;
+        if (len < (int)sizeof(data))
+            data[len] = data[len] << 4 | value;
+        if (++digits % 2 == 0)
+            len++;
+    }
+    if (c != ';' || len < 30)
+        return 0;
+    
+    t->line = counter(data, &at, 2);
+    t->lines_done = counter(data, &at, 2);
+    t->lines = counter(data, &at, 2);
+    t->elapsed = counter(data, &at, 4);
+    t->line_motion = counter(data, &at, 2);
+    t->line_wait = counter(data, &at, 2);
+    t->wait = counter(data, &at, 4);
+    t->stall = counter(data, &at, 4);
+    t->stalls = counter(data, &at, 2);
+    t->rx_overruns = counter(data, &at, 2);
+    t->rx_dropped = counter(data, &at, 2);
+    t->rx_high = counter(data, &at, 1);
+    t->tx_high = counter(data, &at, 1);
+    t->busy = len > at ? counter(data, &at, 1) : 0;
+    return 1;
+}
+
+// Wait for a frame's reply or credit from the controller: 'K', 'N' or 'R'
+// with a seq, 'D' with the end of the window, 'U' with the line a streamed
+// job ran out of data on, or 'T' with the counters in reply_telemetry.
+// Returns 0 on a timeout.
+int get_reply(int timeout, int *reply_seq)
+{
+    while (1)
+    {
+        int response = get_response(timeout);
+        if (response == 'T')
+        {
+            *reply_seq = 0;
+            if (read_telemetry(&reply_telemetry))
+                return response;
+        }
+        else if (response == 'U')
+        {
+            // "#U<line>;"
+            uint8_t c;
+            *reply_seq = 0;
+            while (sp_blocking_read(port, &c, 1, 100) == 1 && c >= '0' && c <= '9')
+                *reply_seq = *reply_seq * 10 + c - '0';
+            return response;
+        }
+        if (response == 'K' || response == 'N' || response == 'R' || response == 'D')
+        {
+            // The seq, and again inverted
+            uint8_t buf[2];
+            if (sp_blocking_read(port, buf, 2, 100) < 2)
+                return 0;
+            int check = buf[1] - '0';
+            *reply_seq = buf[0] - '0';
+            if (*reply_seq >= 0 && *reply_seq < FRAME_SEQS
+                && check == (*reply_seq ^ (FRAME_SEQS - 1)))
+                return response;
+        }
+        else if (response == 0)
+            return 0;
+    }
+}
+
+// Frame up a payload and send it, without waiting for the reply
+void write_frame(uint8_t frame_seq, uint8_t type, const uint8_t *payload, int len)
+{
+    uint8_t frame[len + FRAME_OVERHEAD];
+    uint8_t encoded[len + FRAME_OVERHEAD + (len + FRAME_OVERHEAD) / 254 + 3];
+    
+    frame[0] = frame_seq;
+    frame[1] = type;
+    frame[2] = len & 0xff;
+    frame[3] = len >> 8;
+    memcpy(frame + 4, payload, len);
+    uint16_t crc = 0xffff;
+    int i;
+    for (i = 0; i < len + 4; i++)
+        crc = crc_ccitt_update(crc, frame[i]);
+    frame[len + 4] = crc & 0xff;
+    frame[len + 5] = crc >> 8;
+    
+    int size = cobs_encode(frame, len + FRAME_OVERHEAD, encoded + 1);
+    encoded[0] = 0;
+    encoded[size + 1] = 0;
+    size += 2;
+    stats.sent_bytes += size;
+    serial_write(encoded, size);
+}
+
+// Send a frame and wait for its reply, sending it again if it gets damaged
+// on the way. Returns 1 if the controller took it, 0 if it refused it.
+// Anything else gives up.
+int send_frame(uint8_t type, const uint8_t *payload, int len)
+{
+    int tries;
+    
+    for (tries = 0; tries < FRAME_TRIES; tries++)
+    {
+        if (tries)
+            stats.resent++;
+        write_frame(seq, type, payload, len);
+        sp_drain(port);
+        
+        // Replies for earlier frames (sent again after their reply was
+        // lost) don't count
+        int reply, reply_seq;
+        do
+            reply = get_reply(REPLY_TIMEOUT, &reply_seq);
+        while (reply == 'D' || ((reply == 'K' || reply == 'N') && reply_seq != seq));
+        
+        if (reply == 'K' || reply == 'N')
+        {
+            if (reply == 'K')
+                seq = (seq + 1) % FRAME_SEQS;
+            return reply == 'K';
+        }
+        printf("    %s, sending again\n", reply ? "damaged" : "no reply");
+    }
+    
+    fprintf(stderr, "Gave up after %d tries.\n", FRAME_TRIES);
+    show_debug();
+    exit(5);
+}
+
+// Send one of the controller's settings
+void send_setting(char cmd, uint32_t value)
+{
+    uint8_t payload[5] = {
+        cmd, value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24
+    };
+    printf("--> %c%u\n", cmd, value);
+    if (!send_frame(FRAME_SETTING, payload, sizeof(payload)))
     {
         fprintf(stderr, "Device reported error response.\n");
         show_debug();
         exit(5);
     }
-    else if (response != 'Y')
+    printf("    OK\n");
+}
+
+// Run-length encode len bytes from src into out, returning the encoded size.
+// out needs room for len + len / RLE_LITERAL_MAX + 1 bytes.
+int rle_encode(const uint8_t *src, int len, uint8_t *out)
+{
+    int size = 0;
+    int literal = -1; // index in out of the current literal packet's header
+    int i = 0;
+    
+    while (i < len)
     {
-        printf("Unexpected device reponse: #%c\n", response);
-        show_debug();
-        exit(5);
+        int run = 1;
+        while (i + run < len && run < RLE_RUN_MAX && src[i + run] == src[i])
+            run++;
+        
+        // Two equal bytes are no cheaper as a run, unless they'd start a new literal packet
+        if (run >= RLE_RUN_MIN || (run == 2 && literal < 0))
+        {
+            out[size++] = run + 126;
+            out[size++] = src[i];
+            i += run;
+            literal = -1;
+            continue;
+        }
+        
+        if (literal < 0 || out[literal] == RLE_LITERAL_MAX - 1)
+        {
+            literal = size++;
+            out[literal] = 0;
+        }
+        else
+            out[literal]++;
+        out[size++] = src[i++];
+    }
+    return size;
+}
+
+// Pack len pixels depth bits each, the first in the top bits of each byte,
+// returning the packed size
+int pack_pixels(const uint8_t *line, int len, uint8_t *out)
+{
+    int per_byte = 8 / depth;
+    int size = 0, i, j;
+    
+    if (depth == 8)
+    {
+        memcpy(out, line, len);
+        return len;
+    }
+    for (i = 0; i < len; i += per_byte)
+    {
+        uint8_t byte = 0;
+        for (j = 0; j < per_byte; j++)
+            byte = byte << depth | (i + j < len ? line[i + j] : 0);
+        out[size++] = byte;
+    }
+    return size;
+}
+
+// The span of a line of len pixels: the first pixel that isn't zero, and
+// one past the last. Puts it after the type byte in out.
+int line_span(const uint8_t *line, int len, int *end, uint8_t *out)
+{
+    int first;
+    for (first = 0; first < len && line[first] == 0; first++)
+        ;
+    for (*end = len; *end > first && line[*end - 1] == 0; (*end)--)
+        ;
+    out[1] = first & 0xff;
+    out[2] = first >> 8;
+    out[3] = (*end - first) & 0xff;
+    out[4] = (*end - first) >> 8;
+    return first;
+}
+
+// Encode one line of len pixels as whichever encoding comes out smallest.
+// prev is the line sent before it (all zeroes for the first). Only the span
+// from the first to the last pixel that isn't zero gets sent, as the packed
+// bytes it's in; the line mustn't be blank. out needs room for len + 5 bytes.
+int encode_line(const uint8_t *line, const uint8_t *prev, int len, uint8_t *out)
+{
+    uint8_t rle[len + len / RLE_LITERAL_MAX + 1];
+    uint8_t delta[len];
+    uint8_t packed[len], packed_prev[len];
+    int first, end, size, i;
+    
+    if (memcmp(line, prev, len) == 0)
+    {
+        out[0] = LINE_SAME;
+        return 1;
+    }
+    
+    first = line_span(line, len, &end, out);
+    
+    // The bytes the span is in
+    pack_pixels(line, len, packed);
+    pack_pixels(prev, len, packed_prev);
+    int per_byte = 8 / depth;
+    line = packed + first / per_byte;
+    prev = packed_prev + first / per_byte;
+    len = (end + per_byte - 1) / per_byte - first / per_byte;
+    
+    // Raw to start with
+    out[0] = LINE_RAW;
+    memcpy(out + 5, line, len);
+    size = len;
+    
+    int rle_size = rle_encode(line, len, rle);
+    if (rle_size < size)
+    {
+        out[0] = LINE_RLE;
+        memcpy(out + 5, rle, rle_size);
+        size = rle_size;
+    }
+    
+    for (i = 0; i < len; i++)
+        delta[i] = line[i] ^ prev[i];
+    rle_size = rle_encode(delta, len, rle);
+    if (rle_size < size)
+    {
+        out[0] = LINE_DELTA;
+        memcpy(out + 5, rle, rle_size);
+        size = rle_size;
+    }
+    
+    return size + 5;
+}
+
+// Laser power for a grey level, or with fewer than 8 bits per pixel, the
+// nearest of the palette's evenly spread levels (which at 1 bit is a
+// threshold halfway)
+static inline uint8_t pixel_value(uint8_t grey)
+{
+    int power = 255 - grey;
+    if (depth == 8)
+        return power;
+    int top = (1 << depth) - 1;
+    return (power * top + 127) / 255;
+}
+
+// Palette power levels for pixel values 1 and up
+int make_palette(uint8_t *palette)
+{
+    int top = (1 << depth) - 1;
+    int i;
+    for (i = 1; i <= top; i++)
+        palette[i - 1] = i * 255 / top;
+    return top;
+}
+
+// A piece of a streamed line: len packed bytes as whichever of raw and
+// run-length is smaller. The type goes in out[0] and the data at out + at,
+// after the span in the first piece of a line. Returns the size.
+int encode_piece(const uint8_t *data, int len, uint8_t *out, int at)
+{
+    uint8_t rle[len + len / RLE_LITERAL_MAX + 1];
+    int size = rle_encode(data, len, rle);
+    if (size < len)
+    {
+        out[0] = LINE_RLE;
+        memcpy(out + at, rle, size);
+    }
+    else
+    {
+        out[0] = LINE_RAW;
+        memcpy(out + at, data, len);
+        size = len;
+    }
+    return at + size;
+}
+
+// Image line i as laser power
+void read_line(int i, uint8_t *line)
+{
+    const uint8_t *data = image_line(i);
+    int x;
+    for (x = 0; x < image_x; x++)
+        line[x] = pixel_value(data[x]);
+}
+
+// Count the blank lines (white, or too light to come to anything) from
+// first onwards, up to max of them (and no more than the image's ring of
+// lines can hold)
+int count_blank_lines(int first, int max)
+{
+    int n, x;
+    if (max > IMAGE_RING)
+        max = IMAGE_RING;
+    for (n = 0; n < max && first + n < image_y; n++)
+    {
+        const uint8_t *data = image_line(first + n);
+        for (x = 0; x < image_x; x++)
+        {
+            if (pixel_value(data[x]))
+                return n;
+        }
+    }
+    return n;
+}
+
+// Read the controller's replies as they come in, on a thread of their own,
+// so that they're never held up by frames being written
+void *read_replies(void *arg)
+{
+    while (!atomic_load(&replies_stop))
+    {
+        int reply_seq, reply = get_reply(50, &reply_seq);
+        if (!reply)
+            continue;
+        
+        int n;
+        while ((n = queue_space(&reply_queue)) < 0)
+            usleep(100);
+        replies[n].reply = reply;
+        replies[n].seq = reply_seq;
+        if (reply == 'T')
+            replies[n].telemetry = reply_telemetry;
+        queue_put(&reply_queue);
+    }
+    return NULL;
+}
+
+void stop_replies()
+{
+    atomic_store(&replies_stop, 1);
+    pthread_join(replies_thread, NULL);
+}
+
+// Drop the lines the controller has taken, up to and including seq
+void lines_taken(uint8_t taken)
+{
+    while (pending_count
+        && ((taken - pending[pending_first].seq) & (FRAME_SEQS - 1)) < FRAME_SEQS / 2)
+    {
+        pending_first = (pending_first + 1) % WINDOW_MAX;
+        pending_count--;
+        if (pending_sent)
+            pending_sent--;
+    }
+}
+
+// Send the lines again from seq on. The first mustn't depend on the line
+// before: a damaged frame may have left the controller's copy half changed.
+// Streamed lines never do.
+void lines_again(uint8_t from)
+{
+    int i;
+    for (i = 0; i < pending_sent; i++)
+    {
+        int n = (pending_first + i) % WINDOW_MAX;
+        if (pending[n].seq != from)
+            continue;
+        if (++pending[n].tries >= FRAME_TRIES)
+        {
+            fprintf(stderr, "Gave up after %d tries.\n", FRAME_TRIES);
+            stop_replies();
+            show_debug();
+            exit(5);
+        }
+        if (pending[n].data[0] != LINE_BLANK && !stream)
+        {
+            uint8_t blank[image_x];
+            memset(blank, 0, image_x);
+            pending[n].size = encode_line(pending[n].copy, blank, image_x, pending[n].data);
+        }
+        pending_sent = i;
+        return;
+    }
+}
+
+// Encode the lines to send, ahead of the controller asking for them, on a
+// thread of their own
+void *encode_lines(void *arg)
+{
+    // Each line is encoded relative to the one before; the first to a blank line
+    uint8_t *line = malloc(image_x);
+    uint8_t *prev = calloc(image_x, 1);
+    int i = 0;
+    
+    // Streaming: the packed line, and the part of it still to go
+    uint8_t *packed = malloc(image_x);
+    int piece = 0, piece_end = 0;
+    int per_byte = 8 / depth;
+    
+    // A dry run's estimator reports each line itself
+    int show = !dry_run_lookup;
+    
+    while (i < image_y || piece < piece_end)
+    {
+        int n = queue_space(&encode_queue);
+        if (n < 0)
+        {
+            usleep(100);
+            continue;
+        }
+        
+        uint8_t *out = encoded[n].data;
+        int lines, line_no = i;
+        encoded[n].first = encoded[n].end = 0;
+        if (piece < piece_end)
+        {
+            // The next piece of a streamed line
+            int len = piece_end - piece < STREAM_CHUNK ? piece_end - piece : STREAM_CHUNK;
+            encoded[n].size = encode_piece(packed + piece, len, out, 1);
+            piece += len;
+            lines = 0;
+            line_no = i - 1;
+        }
+        else if ((lines = count_blank_lines(i, 65535)))
+        {
+            // Skip them all in one go
+            memset(line, 0, image_x);
+            out[0] = LINE_BLANK;
+            out[1] = lines & 0xff;
+            out[2] = lines >> 8;
+            encoded[n].size = 3;
+            if (show)
+                printf("Raster lines %d-%d (blank)\n", i, i + lines - 1);
+        }
+        else if (stream)
+        {
+            // In pieces, the first with the span
+            int end;
+            read_line(i, line);
+            lines = 1;
+            pack_pixels(line, image_x, packed);
+            encoded[n].first = line_span(line, image_x, &end, out);
+            encoded[n].end = end;
+            piece = encoded[n].first / per_byte;
+            piece_end = (end + per_byte - 1) / per_byte;
+            if (show)
+                printf("Raster line %d (streamed, %d pieces)\n", i,
+                    (piece_end - piece + STREAM_CHUNK - 1) / STREAM_CHUNK);
+            int len = piece_end - piece < STREAM_CHUNK ? piece_end - piece : STREAM_CHUNK;
+            encoded[n].size = encode_piece(packed + piece, len, out, 5);
+            piece += len;
+        }
+        else
+        {
+            read_line(i, line);
+            lines = 1;
+            encoded[n].first = line_span(line, image_x, &encoded[n].end, out);
+            encoded[n].size = encode_line(line, prev, image_x, out);
+            memcpy(encoded[n].copy, line, image_x);
+            if (show)
+                printf("Raster line %d (%c, %d bytes)\n", i, out[0], encoded[n].size);
+        }
+        if (lines)
+        {
+            stats.lines[out[0]] += lines;
+            stats.raw_bytes += (long)lines * image_x;
+        }
+        
+        encoded[n].line = line_no;
+        encoded[n].lines = lines;
+        queue_put(&encode_queue);
+        if (lines)
+        {
+            uint8_t *swap = prev;
+            prev = line;
+            line = swap;
+        }
+        i += lines;
+        image_release(i);
+    }
+    
+    atomic_store(&encode_done, 1);
+    free(line);
+    free(prev);
+    free(packed);
+    return NULL;
+}
+
+// Whether there are frames still to come from encode_lines()
+int more_frames()
+{
+    int done = atomic_load(&encode_done);
+    return !done || queue_front(&encode_queue) >= 0;
+}
+
+// Wait up to timeout ms for a reply from the controller. With for_frame, stop
+// waiting as soon as there's a new frame to send instead, and return 1.
+// Returns 0 on a timeout.
+int wait_reply(int timeout, int for_frame, int *reply_seq)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int waiting = 0;
+    
+    while (1)
+    {
+        int n = queue_front(&reply_queue);
+        if (n >= 0)
+        {
+            int reply = replies[n].reply;
+            *reply_seq = replies[n].seq;
+            if (reply == 'T')
+                telemetry = replies[n].telemetry;
+            queue_take(&reply_queue);
+            return reply;
+        }
+        if (for_frame && queue_front(&encode_queue) >= 0)
+            return 1;
+        
+        // Found empty: count it once, against the queue it's waiting for
+        if (!waiting)
+        {
+            if (for_frame)
+                encode_queue.empty++;
+            else
+                reply_queue.empty++;
+            waiting = 1;
+        }
+        // Replies usually come quickly, so keep looking for a millisecond
+        // before sleeping between looks
+        double waited = seconds_since(&start);
+        if (waited * 1000 >= timeout)
+            return 0;
+        if (waited < 0.001)
+            sched_yield();
+        else
+            usleep(100);
+    }
+}
+
+// Start encode_lines() going
+pthread_t start_encoding()
+{
+    int n;
+    for (n = 0; n < ENCODE_AHEAD; n++)
+    {
+        encoded[n].data = malloc(image_x + 5);
+        encoded[n].copy = malloc(image_x);
+    }
+    queue_init(&encode_queue, ENCODE_AHEAD);
+    
+    pthread_t encode_thread;
+    pthread_create(&encode_thread, NULL, encode_lines, NULL);
+    return encode_thread;
+}
+
+void stop_encoding(pthread_t encode_thread)
+{
+    int n;
+    pthread_join(encode_thread, NULL);
+    for (n = 0; n < ENCODE_AHEAD; n++)
+    {
+        free(encoded[n].data);
+        free(encoded[n].copy);
+    }
+}
+
+// The size of a frame on the wire, COBS encoded and between zeros
+int frame_bytes(int len)
+{
+    len += FRAME_OVERHEAD;
+    return len + len / 254 + 1 + 2;
+}
+
+// Go through the job without a controller, and estimate how long it'd take
+void dry_run()
+{
+    pthread_t encode_thread = start_encoding();
+    job_t job = {
+        .pixels = image_x,
+        .steps = final_width == -1 ? image_x : final_width,
+        .depth = depth,
+        .stream = stream,
+        .velocity = velocity,
+        .y_velocity = y_velocity,
+        .ramp_steps = ramp_steps,
+        .ramp_lasering = ramp_lasering,
+        .y_steps = y_steps_per_scanline,
+        .baud = baud,
+    };
+    estimate_start(&job);
+    
+    while (more_frames())
+    {
+        int e = queue_front(&encode_queue);
+        if (e < 0)
+        {
+            usleep(100);
+            continue;
+        }
+        estimate_frame(encoded[e].lines, encoded[e].first, encoded[e].end,
+            frame_bytes(encoded[e].size));
+        queue_take(&encode_queue);
+    }
+    stop_encoding(encode_thread);
+    estimate_finish();
+}
+
+double ticks_ms(long ticks)
+{
+    return ticks * CLOCK_TICK_US / 1000.0;
+}
+
+void show_telemetry(const telemetry_t *t)
+{
+    printf("Controller: line %d of %d, %d done in %.1f s. Last line %.1f ms moving, "
+        "its data took %.1f ms.\n", t->line, t->lines, t->lines_done,
+        ticks_ms(t->elapsed) / 1000, ticks_ms(t->line_motion), ticks_ms(t->line_wait));
+    printf("    Waited %.2f s for data, standing still for %.2f s of it %d times. "
+        "Serial: %d overruns, %d dropped, %d bytes received and %d to send waiting at most.\n",
+        ticks_ms(t->wait) / 1000, ticks_ms(t->stall) / 1000, t->stalls,
+        t->rx_overruns, t->rx_dropped, t->rx_high, t->tx_high);
+}
+
+// Once the job's been sent, keep asking for the controller's counters until
+// it says it's finished, and show them as they ended up (and, with
+// --telemetry, as it goes). Returns 0 if it stopped answering first.
+int final_telemetry()
+{
+    struct timespec shown;
+    int reply, reply_seq, tries = 0;
+    clock_gettime(CLOCK_MONOTONIC, &shown);
+    printf("\n");
+    while (tries < FRAME_TRIES)
+    {
+        serial_write("#T", 2);
+        sp_drain(port);
+        do
+            reply = get_reply(500, &reply_seq);
+        while (reply && reply != 'T');
+        if (reply != 'T')
+        {
+            // A damaged frame can leave the controller taking what comes
+            // next as the start of another frame, "#T" and all. One it's
+            // already had gets it back in step, and is only answered.
+            write_frame((seq + FRAME_SEQS - 1) % FRAME_SEQS, FRAME_SETTING,
+                (const uint8_t *)"", 0);
+            tries++;
+            continue;
+        }
+        tries = 0;
+        if (!reply_telemetry.busy)
+        {
+            show_telemetry(&reply_telemetry);
+            return 1;
+        }
+        if (telemetry_interval && seconds_since(&shown) >= telemetry_interval)
+        {
+            show_telemetry(&reply_telemetry);
+            clock_gettime(CLOCK_MONOTONIC, &shown);
+        }
+        usleep(FINISH_POLL_US);
+    }
+    fprintf(stderr, "The controller stopped answering before the job finished.\n");
+    return 0;
+}
+
+// Stream the image to the controller, as many lines ahead as it has room
+// for rather than waiting for each to be asked for. The lines are made and
+// encoded on other threads, and the replies read on another, so that this
+// one only has to write frames and keep track of them.
+void send_lines()
+{
+    int n;
+    for (n = 0; n < WINDOW_MAX; n++)
+    {
+        pending[n].data = malloc(image_x + 5);
+        pending[n].copy = malloc(image_x);
+    }
+    queue_init(&reply_queue, REPLIES_MAX);
+    
+    pthread_t encode_thread = start_encoding();
+    pthread_create(&replies_thread, NULL, read_replies, NULL);
+    
+    struct timespec polled;
+    clock_gettime(CLOCK_MONOTONIC, &polled);
+    while (more_frames() || pending_count)
+    {
+        if (telemetry_interval && seconds_since(&polled) >= telemetry_interval)
+        {
+            serial_write("#T", 2);
+            clock_gettime(CLOCK_MONOTONIC, &polled);
+        }
+        
+        // Send everything there's credit for: lines to send again first,
+        // then new ones. If it runs out of new ones before it runs out of
+        // credit, it waits for them as well as for replies.
+        int for_frame = 0;
+        while (1)
+        {
+            n = (pending_first + pending_sent) % WINDOW_MAX;
+            uint8_t next = pending_sent < pending_count ? pending[n].seq : seq;
+            int allowed = window_end < 0 ? 0 : (window_end - next) & (FRAME_SEQS - 1);
+            if (allowed == 0 || allowed >= FRAME_SEQS / 2)
+                break;
+            
+            if (pending_sent == pending_count)
+            {
+                if (pending_count == WINDOW_MAX)
+                    break;
+                int e = queue_front(&encode_queue);
+                if (e < 0)
+                {
+                    for_frame = more_frames();
+                    break;
+                }
+                
+                // Trade buffers with the queue rather than copying
+                uint8_t *swap = pending[n].data;
+                pending[n].data = encoded[e].data;
+                encoded[e].data = swap;
+                swap = pending[n].copy;
+                pending[n].copy = encoded[e].copy;
+                encoded[e].copy = swap;
+                pending[n].size = encoded[e].size;
+                pending[n].line = encoded[e].line;
+                pending[n].lines = encoded[e].lines;
+                queue_take(&encode_queue);
+                
+                pending[n].seq = seq;
+                pending[n].sent = 0;
+                pending[n].tries = 0;
+                pending_count++;
+                seq = (seq + 1) % FRAME_SEQS;
+            }
+            
+            if (pending[n].sent++)
+                stats.resent++;
+            write_frame(pending[n].seq, FRAME_LINE, pending[n].data, pending[n].size);
+            clock_gettime(CLOCK_MONOTONIC, &pending[n].sent_at);
+            pending_sent++;
+        }
+        
+        if (!for_frame)
+            sp_drain(port);
+        
+        // The oldest line's reply is waited for from when it was sent, not
+        // from the last reply of any sort: while a streamed line is lasered
+        // credit keeps coming, and would put it off for ever
+        int timeout = pending_count ? REPLY_TIMEOUT : CREDIT_TIMEOUT;
+        if (pending_sent)
+        {
+            timeout -= seconds_since(&pending[pending_first].sent_at) * 1000;
+            if (timeout < 0)
+                timeout = 0;
+        }
+        int reply, reply_seq;
+        reply = wait_reply(timeout, for_frame, &reply_seq);
+        if (reply == 1)
+            continue;
+        else if (reply == 'T')
+            show_telemetry(&telemetry);
+        else if (reply == 'D')
+            window_end = reply_seq;
+        else if (reply == 'K')
+            lines_taken(reply_seq);
+        else if (reply == 'U')
+        {
+            fprintf(stderr, "The controller ran out of data on line %d, so the job has stopped.\n"
+                "Try a higher baud rate or a lower velocity.\n", reply_seq);
+            exit(6);
+        }
+        else if (reply == 'N' || reply == 'R')
+        {
+            // Refused: no room for it after all
+            if (reply == 'N')
+                window_end = reply_seq;
+            printf("    Line frame %d %s, sending again\n", reply_seq,
+                reply == 'R' ? "damaged" : "refused");
+            lines_again(reply_seq);
+        }
+        else
+        {
+            // The reply or the credit went missing
+            if (pending_count)
+            {
+                printf("    No reply, sending again\n");
+                lines_again(pending[pending_first].seq);
+            }
+            else
+                serial_write("#D", 2);
+        }
     }
+    
+    stop_replies();
+    stop_encoding(encode_thread);
+    for (n = 0; n < WINDOW_MAX; n++)
+    {
+        free(pending[n].data);
+        free(pending[n].copy);
+    }
+}
+
+void show_stats(double seconds)
+{
+    printf("\nLines: %d raw, %d run-length, %d same, %d delta, %d blank\n",
+        stats.lines[LINE_RAW], stats.lines[LINE_RLE],
+        stats.lines[LINE_SAME], stats.lines[LINE_DELTA],
+        stats.lines[LINE_BLANK]);
+    if (stats.resent)
+        printf("%d frames sent again\n", stats.resent);
+    printf("Sent %ld bytes for %ld bytes of image data (%.1f%%, ratio %.2f:1)\n",
+        stats.sent_bytes, stats.raw_bytes,
+        stats.raw_bytes ? 100.0 * stats.sent_bytes / stats.raw_bytes : 0.0,
+        stats.sent_bytes ? (double)stats.raw_bytes / stats.sent_bytes : 0.0);
+    if (seconds > 0)
+        printf("%.1f seconds: %.1f lines/min, %.0f image bytes/s, %.0f link bytes/s\n",
+            seconds, image_y * 60 / seconds,
+            stats.raw_bytes / seconds, stats.sent_bytes / seconds);
+    printf("%ld writes to the port, %.3f seconds in them\n",
+        stats.writes, stats.write_seconds);
+    image_show_stats();
+    queue_show_stats(&encode_queue, "Frames encoded ahead");
+    queue_show_stats(&reply_queue, "Replies");
 }
 
-void send_command(const char *command)
+// The controller's step interrupt timing for the job, once it's finished,
+// if it was built with ISR_STATS: "#I" then "<count>,<least>,<mean>,<most>,
+// <latest start>,<overruns>;" for the interrupt starting each step pulse and
+// the one ending it, in clock cycles
+void show_isr_stats()
 {
-    printf("--> %s\n", command);
-    sp_nonblocking_write(port, command, strlen(command));
+    static const char *names[2] = { "Step interrupt", "Pulse interrupt" };
+    long value[6];
+    int i, n, response;
+    uint8_t c;
+    
+    // Replies to the last lines may still be on their way
+    serial_write("#I", 2);
     sp_drain(port);
-    wait_for_ok();
-    printf("    OK\n");
+    do
+        response = get_response(500);
+    while (response && response != 'I' && response != '?');
+    if (response != 'I')
+        return;
+    for (i = 0; i < 2; i++)
+    {
+        for (n = 0; n < 6; n++)
+        {
+            value[n] = 0;
+            while (sp_blocking_read(port, &c, 1, 100) == 1 && c >= '0' && c <= '9')
+                value[n] = value[n] * 10 + c - '0';
+        }
+        printf("%s: %ld times, %ld-%ld cycles (%ld on average), up to %ld late starting, "
+            "%ld overran the next step\n", names[i], value[0], value[1], value[3],
+            value[2], value[4], value[5]);
+    }
 }
 
 int do_parameters(int argc, char **argv)
@@ -111,12 +1196,44 @@ int do_parameters(int argc, char **argv)
     y_steps_per_scanline = 5;
     ramp_steps = 1000;
     velocity = 500;
+    y_velocity = 2000;
+    ramp_lasering = 0;
+    depth = 0;
+    dither = DITHER_NONE;
     final_width = -1;
+    final_height = -1;
+    filter = RESAMPLE_LANCZOS;
+    baud = START_BAUD;
+    flow = FLOW_XONXOFF;
+    dry_run_lookup = NULL;
+    telemetry_interval = 0;
+    byte_writes = 0;
+    
+    static const struct option long_options[] = {
+        { "dry-run", required_argument, NULL, 'n' },
+        { "telemetry", required_argument, NULL, 'm' },
+        { "byte-writes", no_argument, &byte_writes, 1 },
+        { NULL, 0, NULL, 0 }
+    };
         
-    while ((c = getopt(argc, argv, "b:v:r:s:w:")) != -1)
+    while ((c = getopt_long(argc, argv, "ab:d:f:h:i:l:t:v:r:s:w:y:", long_options, NULL)) != -1)
     {
         switch (c)
         {
+            case 'n':
+                dry_run_lookup = optarg;
+                break;
+            case 'm':
+                telemetry_interval = atof(optarg);
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                if (depth != 1 && depth != 2 && depth != 4 && depth != 8)
+                {
+                    fprintf(stderr, "Bits per pixel must be 1, 2, 4 or 8.\n");
+                    exit(1);
+                }
+                break;
             case 'b':
                 backlash_compensation_steps = atoi(optarg);
                 break;
@@ -132,9 +1249,68 @@ int do_parameters(int argc, char **argv)
             case 'w':
                 final_width = atoi(optarg);
                 break;
+            case 'h':
+                final_height = atoi(optarg);
+                break;
+            case 'i':
+                if (optarg[0] == 'n')
+                    filter = RESAMPLE_NONE;
+                else if (optarg[0] == 'x')
+                    filter = RESAMPLE_BOX;
+                else if (optarg[0] == 'b')
+                    filter = RESAMPLE_BILINEAR;
+                else if (optarg[0] == 'l')
+                    filter = RESAMPLE_LANCZOS;
+                else
+                {
+                    fprintf(stderr, "Resampling must be n, x, b or l.\n");
+                    exit(1);
+                }
+                break;
+            case 'y':
+                y_velocity = atoi(optarg);
+                break;
+            case 'a':
+                ramp_lasering = 1;
+                break;
+            case 'l':
+                baud = atoi(optarg);
+                break;
+            case 't':
+                if (optarg[0] == 'f')
+                    dither = DITHER_FLOYD;
+                else if (optarg[0] == 'j')
+                    dither = DITHER_JARVIS;
+                else if (optarg[0] == 'a')
+                    dither = DITHER_ATKINSON;
+                else if (optarg[0] == 'o')
+                    dither = DITHER_BAYER;
+                else
+                {
+                    fprintf(stderr, "Dithering must be f, j, a or o.\n");
+                    exit(1);
+                }
+                break;
+            case 'f':
+                if (optarg[0] == 'n')
+                    flow = FLOW_NONE;
+                else if (optarg[0] == 'x')
+                    flow = FLOW_XONXOFF;
+                else if (optarg[0] == 'h')
+                    flow = FLOW_RTSCTS;
+                else
+                {
+                    fprintf(stderr, "Flow control must be n, x or h.\n");
+                    exit(1);
+                }
+                break;
         }
     }
     
+    // Dithering is mostly for 1 bit per pixel, so that's the default for it
+    if (depth == 0)
+        depth = dither ? 1 : 8;
+    
     return optind;
 }
 
@@ -145,11 +1321,23 @@ int main(int argc, char **argv)
     if (argc == lastopt)
     {
         fprintf(stderr, "\nusage: %s [options] imagefilename\n", argv[0]);
-        fprintf(stderr, "\n\t-b steps:\tBacklash compensation in steps\n");
+        fprintf(stderr, "\n\t-a\t\tLaser while speeding up and slowing down\n");
+        fprintf(stderr, "\t-b steps:\tBacklash compensation in steps\n");
+        fprintf(stderr, "\t-d bits:\tBits per pixel: 1, 2, 4 or 8 (default, or 1 when dithering)\n");
+        fprintf(stderr, "\t-f n|x|h:\tFlow control: none, XON/XOFF (default) or RTS/CTS\n");
+        fprintf(stderr, "\t-h steps:\tHeight of the scaled image in steps\n");
+        fprintf(stderr, "\t-i n|x|b|l:\tResampling: none, box, bilinear or Lanczos (default)\n");
+        fprintf(stderr, "\t-l baud:\tBaud rate to switch to, e.g. 250000, 500000 or 1000000\n");
         fprintf(stderr, "\t-r steps:\tRamp up/down distance in steps\n");
+        fprintf(stderr, "\t-t f|j|a|o:\tDither: Floyd-Steinberg, Jarvis, Atkinson or ordered\n");
         fprintf(stderr, "\t-v steps:\tVelocity given as step time in 2MHz clocks\n");
         fprintf(stderr, "\t-s steps:\tDistance between scanlines in steps\n");
         fprintf(stderr, "\t-w steps:\tWidth of the scaled image in steps\n");
+        fprintf(stderr, "\t-y steps:\tY axis velocity given as step time in 2MHz clocks\n");
+        fprintf(stderr, "\t--dry-run lookup.bin:\tJust estimate how long it'd take, with the controller's\n"
+            "\t\t\tacceleration table (and jerk.bin next to it)\n");
+        fprintf(stderr, "\t--telemetry seconds:\tShow the controller's counters this often during the job\n");
+        fprintf(stderr, "\t--byte-writes:\tWrite to the port a byte at a time, to compare\n");
         fprintf(stderr, "\n");
         
         exit(1); 
@@ -158,23 +1346,79 @@ int main(int argc, char **argv)
     printf("FreeImage version: %s\n", FreeImage_GetVersion());
     
     const char *filename = argv[lastopt];
-    FREE_IMAGE_FORMAT fmt = FreeImage_GetFileType(filename, 0);
-    FIBITMAP *src_image = FreeImage_Load(fmt, filename, 0);
-    FIBITMAP *image = FreeImage_ConvertToGreyscale(src_image);
-    FreeImage_Unload(src_image);
-
-    
-    if (image == 0)
+    int width, height;
+    if (!image_open(filename, &width, &height))
     {
         fprintf(stderr, "Couldn't load %s.\n", filename);
         exit(1);
     }
-    
-    image_x = FreeImage_GetWidth(image);
-    image_y = FreeImage_GetHeight(image);
 
     printf("Image dimensions: %dx%d\n",
-        image_x, image_y);
+        width, height);
+    
+    // Resample to a pixel for each step across and a line for each
+    // scanline down, so that the controller doesn't have to scale anything.
+    // Not across if the lines would have to be streamed and otherwise
+    // wouldn't, though, or would have more pixels than a line can: the
+    // controller can stretch them itself.
+    int lines = final_height == -1 ? height : final_height / y_steps_per_scanline;
+    int steps = final_width == -1 ? width : final_width;
+    if (lines < 1)
+        lines = 1;
+    if (((long)steps * depth + 7) / 8 > MAX_BUF && (width * depth + 7) / 8 <= MAX_BUF)
+    {
+        printf("Lines %d steps long wouldn't fit in the controller, so it'll stretch them.\n",
+            steps);
+        steps = width;
+    }
+    else if (steps > 65535 && width <= 65535)
+    {
+        printf("Lines %d steps long would have too many pixels, so the controller will "
+            "stretch them.\n", steps);
+        steps = width;
+    }
+    if (filter == RESAMPLE_NONE)
+    {
+        if (lines != height)
+        {
+            fprintf(stderr, "The height can't be changed without resampling.\n");
+            exit(1);
+        }
+    }
+    else if (steps != width || lines != height)
+    {
+        width = steps;
+        height = lines;
+        printf("Resampling to %dx%d\n", width, height);
+    }
+    
+    if (width > 65535 || height > 65535)
+    {
+        fprintf(stderr, "Image is too big: at most 65535 pixels either way.\n");
+        exit(1);
+    }
+    image_x = width;
+    image_y = height;
+    
+    // In the background, a little ahead of each line being sent
+    image_start(image_x, image_y, filter, dither, 1 << depth);
+    
+    stream = (image_x * depth + 7) / 8 > MAX_BUF;
+    if (stream)
+    {
+        printf("Lines are too wide for the controller to hold, so they'll be streamed.\n");
+    }
+    
+    if (dry_run_lookup)
+    {
+        if (!estimate_tables(dry_run_lookup))
+        {
+            fprintf(stderr, "Couldn't load the acceleration tables from %s.\n", dry_run_lookup);
+            exit(1);
+        }
+        dry_run();
+        return 0;
+    }
     
 	sp_return_t result = sp_get_port_by_name(serial_port, &port);
 
@@ -195,7 +1439,7 @@ int main(int argc, char **argv)
     // Set up port parameters
     sp_port_config_t *conf;
     result = sp_new_config(&conf);
-    result = result == SP_OK ? sp_set_config_baudrate(conf, 57600) : result;
+    result = result == SP_OK ? sp_set_config_baudrate(conf, START_BAUD) : result;
     result = result == SP_OK ? sp_set_config_parity(conf, SP_PARITY_NONE) : result;
     result = result == SP_OK ? sp_set_config_bits(conf, 8) : result;
     result = result == SP_OK ? sp_set_config_stopbits(conf, 1) : result;
@@ -232,70 +1476,97 @@ int main(int argc, char **argv)
     }
 
     printf("# Got handshake.\n");
-
-    // Send image parameters
-    // FIXME: swap image_x and pixels
-    sprintf((char *)buf, "#P%d;", image_x);
-    send_command((const char *)buf);
-    sprintf((char *)buf, "#Y%d;", image_y);
-    send_command((const char *)buf);
-    sprintf((char *)buf, "#B%d;", backlash_compensation_steps);
-    send_command((const char *)buf);
-    sprintf((char *)buf, "#S%d;", y_steps_per_scanline);
-    send_command((const char *)buf);
-    sprintf((char *)buf, "#R%d;", ramp_steps);
-    send_command((const char *)buf);
-    sprintf((char *)buf, "#V%d;", velocity);
-    send_command((const char *)buf);
-    
-    if (final_width == -1)
-        sprintf((char *)buf, "#X%d;", image_x);        
-    else
-        sprintf((char *)buf, "#X%d;", final_width);
-    send_command((const char *)buf);
-        
-    send_command("#!");
-
-    // Send image data line by line
-    int i;
-    for (i = 0; i < image_y; i++)
+    
+    // Flow control from the controller's end goes on first, so it's there
+    // for everything after
+    send_setting('F', flow);
+    if (flow == FLOW_XONXOFF)
+        result = sp_set_xon_xoff(port, SP_XONXOFF_OUT);
+    else if (flow == FLOW_RTSCTS)
+        result = sp_set_flowcontrol(port, SP_FLOWCONTROL_RTSCTS);
+    if (result != SP_OK)
+    {
+        fprintf(stderr, "Couldn't set flow control\n");
+        exit(3);
+    }
+    
+    // Then the baud rate: the controller switches once its reply is out, and
+    // the handshake is done again at the new rate
+    if (baud != START_BAUD)
     {
-        int response = get_response(0);
-        if (response == 0)
+        if (baud <= 0)
         {
-            fprintf(stderr, "No response from device.\n");
-            show_debug();
-            exit(5);
-        } 
-        else if (response == 'N')
+            fprintf(stderr, "Bad baud rate %d.\n", baud);
+            exit(1);
+        }
+        send_setting('L', baud);
+        if (sp_set_baudrate(port, baud) != SP_OK)
         {
-            fprintf(stderr, "Device reported error response.\n");
-            show_debug();
-            exit(5);
+            fprintf(stderr, "Couldn't set baud rate %d\n", baud);
+            exit(3);
         }
-        else if (response != 'D')
+        usleep(10000);
+        
+        if (handshake() == 0)
         {
-            fprintf(stderr, "Incorrect response (%c) from device.\n", response);
-            show_debug();
-            exit(5);
+            fprintf(stderr, "Didn't receive handshake at %d baud.\n", baud);
+            exit(4);
         }
-        printf("Raster line %d\n", i);
+        printf("# Got handshake at %d baud.\n", baud);
         
-        /* Begin sending line data */    
-        uint8_t *data = FreeImage_GetScanLine(image, image_y - i - 1);
-        int x;
-        for (x = 0; x < image_x; x++)
+        // which starts the controller's frames over
+        seq = 0;
+    }
+
+    // Send image parameters
+    // FIXME: swap image_x and pixels
+    send_setting('P', image_x);
+    send_setting('G', depth);
+    if (depth < 8)
+    {
+        uint8_t palette[15];
+        int len = make_palette(palette);
+        printf("--> palette\n");
+        if (!send_frame(FRAME_PALETTE, palette, len))
         {
-            uint8_t value = 255 - data[x];
-            sp_nonblocking_write(port, &value, 1);
-        }        
+            fprintf(stderr, "Device refused the palette.\n");
+            exit(5);
+        }
+        printf("    OK\n");
+    }
+    send_setting('Y', image_y);
+    send_setting('B', backlash_compensation_steps);
+    send_setting('S', y_steps_per_scanline);
+    send_setting('R', ramp_steps);
+    send_setting('V', velocity);
+    send_setting('U', y_velocity);
+    send_setting('A', ramp_lasering);
+    send_setting('X', final_width == -1 ? image_x : final_width);
     
+    printf("--> start\n");
+    if (!send_frame(FRAME_START, 0, 0))
+    {
+        fprintf(stderr, "Device refused to start.\n");
+        exit(5);
     }
+    printf("    OK\n");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stats.sent_bytes = 0;
+    stats.writes = 0;
+    stats.write_seconds = 0;
+    send_lines();
 
-    FreeImage_Unload(image);
-	sp_close(port);
+    // Timed to the last line leaving, not to it being lasered
+    sp_drain(port);
+    show_stats(seconds_since(&start));
+    if (final_telemetry())
+        show_isr_stats();
+
+    sp_close(port);
     sp_free_config(conf);
-	sp_free_port(port);
+    sp_free_port(port);
 
-	return 0;
+    return 0;
 }
@@ -0,0 +1,55 @@
+#include <stdio.h>
+
+#include "queue.h"
+
+void queue_init(queue_t *q, int size)
+{
+    q->size = size;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->taken = q->depth_total = q->empty = 0;
+    q->depth_max = 0;
+}
+
+// head and tail just count up; the slot is the count modulo size
+int queue_space(queue_t *q)
+{
+    int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head - tail >= q->size)
+        return -1;
+    return (unsigned)head % q->size;
+}
+
+void queue_put(queue_t *q)
+{
+    int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
+
+int queue_front(queue_t *q)
+{
+    int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    int head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (head == tail)
+        return -1;
+    return (unsigned)tail % q->size;
+}
+
+void queue_take(queue_t *q)
+{
+    int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    int depth = atomic_load_explicit(&q->head, memory_order_relaxed) - tail;
+    q->taken++;
+    q->depth_total += depth;
+    if (depth > q->depth_max)
+        q->depth_max = depth;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+void queue_show_stats(const queue_t *q, const char *name)
+{
+    printf("%s: %ld taken, %.1f deep on average, %d at most, found empty %ld times\n",
+        name, q->taken, q->taken ? (double)q->depth_total / q->taken : 0.0,
+        q->depth_max, q->empty);
+}
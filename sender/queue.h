@@ -0,0 +1,34 @@
+#ifndef __QUEUE_H
+#define __QUEUE_H
+
+#include <stdatomic.h>
+
+// A bounded queue from one thread to one other, without locks. The queue
+// only hands out slot numbers: what's in each slot is kept by whoever uses
+// it, in an array of size entries. Only the thread putting things in moves
+// head, and only the one taking them out moves tail.
+typedef struct {
+    int size;
+    atomic_int head, tail;
+
+    // How full it was each time something was taken, and how many times
+    // the thread taking things out had to wait for it (which it counts)
+    long taken, depth_total, empty;
+    int depth_max;
+} queue_t;
+
+void queue_init(queue_t *q, int size);
+
+// The slot to fill next, or -1 if the queue's full. It goes in the queue
+// with queue_put().
+int queue_space(queue_t *q);
+void queue_put(queue_t *q);
+
+// The slot at the front of the queue, or -1 if it's empty. It stays there
+// until queue_take().
+int queue_front(queue_t *q);
+void queue_take(queue_t *q);
+
+void queue_show_stats(const queue_t *q, const char *name);
+
+#endif
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "resample.h"
+
+// Each output pixel is a weighted sum of a run of input pixels along one
+// axis: taps of them from first, clamped to the edge of the image
+typedef struct {
+    int first;
+    int taps;
+    float *weight;
+} contrib_t;
+
+static int src_w, src_h, dst_w, dst_h;
+static contrib_t *across, *down;
+static int max_taps;
+static source_fn source;
+
+// Source lines resampled across, kept while the following output lines
+// still need them: line y is in slot y % max_taps
+struct resample_cache {
+    float *lines;
+    int *held;
+    float *acc;
+    uint8_t *buf;
+};
+
+static double sinc(double x)
+{
+    if (x == 0)
+        return 1;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double filter_weight(int filter, double t)
+{
+    t = fabs(t);
+    if (filter == RESAMPLE_BOX)
+        return t <= 0.5 ? 1 : 0;
+    if (filter == RESAMPLE_BILINEAR)
+        return t < 1 ? 1 - t : 0;
+    return t < 3 ? sinc(t) * sinc(t / 3) : 0;
+}
+
+static double filter_radius(int filter)
+{
+    if (filter == RESAMPLE_BOX)
+        return 0.5;
+    if (filter == RESAMPLE_BILINEAR)
+        return 1;
+    return 3;
+}
+
+// Weights for resampling n pixels to out. Shrinking, the filter's stretched
+// to cover all the pixels each output one stands for.
+static contrib_t *make_contribs(int n, int out, int filter)
+{
+    contrib_t *contribs = malloc(out * sizeof(contrib_t));
+    double scale = (double)n / out;
+    double stretch = scale > 1 ? scale : 1;
+    double radius = filter_radius(filter) * stretch;
+    int i, j;
+
+    for (i = 0; i < out; i++)
+    {
+        double centre = (i + 0.5) * scale - 0.5;
+        int first = (int)floor(centre - radius);
+        int last = (int)ceil(centre + radius);
+        contrib_t *c = &contribs[i];
+        c->weight = malloc((last - first + 1) * sizeof(float));
+        c->first = first;
+        c->taps = last - first + 1;
+
+        double total = 0;
+        for (j = 0; j < c->taps; j++)
+        {
+            c->weight[j] = filter_weight(filter, (first + j - centre) / stretch);
+            total += c->weight[j];
+        }
+
+        // Nothing close enough (a box growing an image exactly between two
+        // pixels): the nearest one
+        if (total == 0)
+        {
+            for (j = 0; j < c->taps; j++)
+                c->weight[j] = first + j == (int)floor(centre + 0.5);
+            total = 1;
+        }
+        for (j = 0; j < c->taps; j++)
+            c->weight[j] /= total;
+
+        if (c->taps > max_taps)
+            max_taps = c->taps;
+    }
+    return contribs;
+}
+
+static inline int clamp_index(int i, int n)
+{
+    return i < 0 ? 0 : i >= n ? n - 1 : i;
+}
+
+void resample_init(int src_width, int src_height, int width, int height, int filter,
+    source_fn source_in)
+{
+    src_w = src_width;
+    src_h = src_height;
+    dst_w = width;
+    dst_h = height;
+    source = source_in;
+    across = make_contribs(src_w, dst_w, filter);
+    down = make_contribs(src_h, dst_h, filter);
+}
+
+resample_cache_t *resample_cache()
+{
+    int width = (dst_w + 3) & ~3;
+    int j;
+    resample_cache_t *cache = malloc(sizeof(resample_cache_t));
+    cache->lines = calloc((size_t)max_taps * width, sizeof(float));
+    cache->held = malloc(max_taps * sizeof(int));
+    cache->acc = malloc(width * sizeof(float));
+    cache->buf = malloc(src_w);
+    for (j = 0; j < max_taps; j++)
+        cache->held[j] = -1;
+    return cache;
+}
+
+// Source line y, resampled across
+static void resample_across(int y, float *out, uint8_t *buf)
+{
+    const uint8_t *in = source(y, buf);
+    int x, j;
+    for (x = 0; x < dst_w; x++)
+    {
+        const contrib_t *c = &across[x];
+        float sum = 0;
+        if (c->first >= 0 && c->first + c->taps <= src_w)
+        {
+            const uint8_t *p = in + c->first;
+            for (j = 0; j < c->taps; j++)
+                sum += p[j] * c->weight[j];
+        }
+        else
+        {
+            for (j = 0; j < c->taps; j++)
+                sum += in[clamp_index(c->first + j, src_w)] * c->weight[j];
+        }
+        out[x] = sum;
+    }
+}
+
+// Down the image, 4 pixels at a time: each output line is a weighted sum of
+// whole lines already resampled across
+typedef float v4f __attribute__((vector_size(16)));
+
+void resample_line(int y, uint8_t *out, resample_cache_t *cache)
+{
+    const contrib_t *c = &down[y];
+    int width = (dst_w + 3) & ~3;
+    float *acc = cache->acc;
+    int j, x;
+
+    memset(acc, 0, width * sizeof(float));
+    for (j = 0; j < c->taps; j++)
+    {
+        int src_y = clamp_index(c->first + j, src_h);
+        int slot = src_y % max_taps;
+        float *line = cache->lines + (size_t)slot * width;
+        if (cache->held[slot] != src_y)
+        {
+            resample_across(src_y, line, cache->buf);
+            cache->held[slot] = src_y;
+        }
+
+        v4f w = { c->weight[j], c->weight[j], c->weight[j], c->weight[j] };
+        for (x = 0; x < width; x += 4)
+        {
+            v4f a, l;
+            memcpy(&a, acc + x, sizeof(a));
+            memcpy(&l, line + x, sizeof(l));
+            a += w * l;
+            memcpy(acc + x, &a, sizeof(a));
+        }
+    }
+
+    for (x = 0; x < dst_w; x++)
+    {
+        float v = acc[x] + 0.5f;
+        out[x] = v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+    }
+}
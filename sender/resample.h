@@ -0,0 +1,29 @@
+#ifndef __RESAMPLE_H
+#define __RESAMPLE_H
+
+#include <stdint.h>
+
+#define RESAMPLE_NONE 0         // leave it to the controller
+#define RESAMPLE_BOX 1          // average of the pixels each one covers
+#define RESAMPLE_BILINEAR 2
+#define RESAMPLE_LANCZOS 3      // Lanczos with 3 lobes: the sharpest
+
+// Where the source image's lines come from: line y, counting from the top,
+// either from wherever it already is or made in buf
+typedef const uint8_t *(*source_fn)(int y, uint8_t *buf);
+
+// What each thread resampling keeps between lines
+typedef struct resample_cache resample_cache_t;
+
+// Set up for resampling a src_w x src_h image to width x height with the
+// given filter
+void resample_init(int src_w, int src_h, int width, int height, int filter,
+    source_fn source);
+
+resample_cache_t *resample_cache();
+
+// Line y of the resampled image, into out. A thread's lines are quickest
+// done in order.
+void resample_line(int y, uint8_t *out, resample_cache_t *cache);
+
+#endif
@@ -1,27 +1,54 @@
 #include <avr/io.h>
 #include <util/delay_basic.h>
 #include <avr/interrupt.h>
+#include <string.h>
 
 #include "serial.h"
 
-// FIFOs on both send and receive
+// FIFOs on both send and receive. Each has one end written only by an
+// interrupt and the other only by the main loop, so neither needs interrupts
+// turned off: the head only moves once the byte's in, and the tail once it's
+// out. Both run freely and are masked down to the buffer size.
 volatile uint8_t rx_buffer[RXBUFFER];
 volatile uint8_t tx_buffer[TXBUFFER];
-volatile uint8_t rx_ptr, rx_len, tx_ptr, tx_len, tx_idle;
+volatile uint8_t rx_head, rx_tail, tx_head, tx_tail, tx_idle;
+
+#define RX_MASK (RXBUFFER - 1)
+#define TX_MASK (TXBUFFER - 1)
+
+static volatile struct serial_stats stats;
+
+// Flow control mode, whether the sender's been told to stop, and an XON or
+// XOFF waiting to go out ahead of everything else
+uint8_t flow_mode;
+volatile uint8_t rx_stopped, tx_flow;
+
+// UBRR for a baud rate with the double-speed clock (U2X), or -1 if it can't
+// be got to within 2%. At 16MHz 250k, 500k and 1M are exact.
+int16_t serial_ubrr(uint32_t baud)
+{
+    if (baud == 0)
+        return -1;
+    uint32_t ubrr = (F_CPU / 8 + baud / 2) / baud;
+    if (ubrr == 0 || ubrr > 4096)
+        return -1;
+    uint32_t actual = F_CPU / 8 / ubrr;
+    uint32_t error = actual > baud ? actual - baud : baud - actual;
+    if (error > baud / 50)
+        return -1;
+    return ubrr - 1;
+}
+
+static void set_ubrr(uint16_t ubrr)
+{
+	UBRR0H = ubrr >> 8;
+	UBRR0L = ubrr & 0xFF;
+	UCSR0A = _BV(U2X0);
+}
 
 void serial_init()
 {
-	unsigned int ubrr;
-	switch (FBAUD) {
-		case 115200:
-			ubrr = 8;
-			break;
-		default:
-			ubrr = (F_CPU / 16 / FBAUD) - 1;
-	}
-
-	UBRR0H = (unsigned char)ubrr >> 8;
-	UBRR0L = (unsigned char)ubrr & 0xFF;
+	set_ubrr(serial_ubrr(FBAUD));
 	
 	UCSR0B = _BV(RXEN0) | _BV(TXEN0);
 
@@ -32,44 +59,65 @@ void serial_init()
 	DDRD |= _BV(PORTD1);
 
     // Empty buffers
-    rx_ptr = 0;
-    rx_len = 0;
-    tx_ptr = 0;
-    tx_len = 0;
+    rx_head = 0;
+    rx_tail = 0;
+    tx_head = 0;
+    tx_tail = 0;
     tx_idle = 1;
+    flow_mode = FLOW_NONE;
+    rx_stopped = 0;
+    tx_flow = 0;
     
-	// Enable interrupts
-	UCSR0B |= _BV(RXCIE0) | _BV(UDRIE0);
+	// Enable interrupts. The data register empty one is only enabled while
+	// there's something to send.
+	UCSR0B |= _BV(RXCIE0);
 }
 
+// Get the data register empty interrupt going if it isn't. From the main
+// loop, an interrupt can come along halfway through changing UCSR0B, but it
+// only ever turns this same bit on, or off once everything's gone out, in
+// which case turning it back on just costs one more interrupt that finds
+// nothing to send.
+static inline void tx_start()
+{
+    tx_idle = 0;
+    UCSR0B |= _BV(UDRIE0);
+}
+
+// Put data into buffer; the interrupt sends it
 void tx_char(unsigned char data)
 {
-    // FIXME: we don't have to disable ALL interrupts...
-    if (tx_idle)
+    tx_buffer[tx_head & TX_MASK] = data;
+    tx_head++;
+    tx_start();
+    
+    uint8_t len = tx_head - tx_tail;
+    if (len > stats.tx_high)
+        stats.tx_high = len;
+}
+
+// Tell the sender to stop or carry on. Called with interrupts off.
+static void flow(uint8_t stop)
+{
+    rx_stopped = stop;
+    if (flow_mode == FLOW_XONXOFF)
     {
-        // If there's no character already being sent
-        tx_idle = 0;
-        cli();
-        
-        // Re-enable interrupt
-        UCSR0B |= _BV(UDRIE0);
-	    
-	    /* Put data into buffer, sends the data */
-        UDR0 = data;
-        sei();
-        return;
+        tx_flow = stop ? XOFF : XON;
+        tx_start();
+    }
+    else if (flow_mode == FLOW_RTSCTS)
+    {
+        if (stop)
+            RTS_PORT |= _BV(RTS_BIT);
+        else
+            RTS_PORT &= ~_BV(RTS_BIT);
     }
-                
-    // Put data into buffer
-    cli();
-    tx_buffer[(tx_ptr + tx_len++) % TXBUFFER] = data;
-    sei();
 }
 
 void serial_sendchar(unsigned char data)
 {
-    // Wait for buffer to have room. OK to spin on tx_len because it's 8 bits.
-    while (tx_len == TXBUFFER)
+    // Wait for buffer to have room
+    while ((uint8_t)(tx_head - tx_tail) == TXBUFFER)
         ;
     tx_char(data);
 }
@@ -83,50 +131,160 @@ void serial_send(char *s)
     }
 }
 
+// Let the sender carry on once there's room again, after taking bytes out.
+// The interrupt might be stopping it at the same time, so this one does have
+// to be done with interrupts off, but it's only once per hold-off.
+static void rx_taken()
+{
+    if (!rx_stopped)
+        return;
+    cli();
+    if (rx_stopped && (uint8_t)(rx_head - rx_tail) <= RX_GO)
+        flow(0);
+    sei();
+}
+
 // Return character from RX buffer if available, otherwise return -1
 int16_t serial_receive_nowait()
 {
-    uint16_t data;
+    uint8_t tail = rx_tail;
+    if (rx_head == tail)
+        return -1;
+    uint8_t data = rx_buffer[tail & RX_MASK];
+    rx_tail = tail + 1;
+    rx_taken();
+    return data;
+}
+
+// Take up to size bytes out of the RX buffer at once. Returns how many.
+uint8_t serial_receive_block(uint8_t *buf, uint8_t size)
+{
+    uint8_t tail = rx_tail;
+    uint8_t len = rx_head - tail;
+    if (len > size)
+        len = size;
+    
+    // In two goes if it wraps around the end of the buffer
+    uint8_t at = tail & RX_MASK;
+    uint8_t first = RXBUFFER - at;
+    if (first > len)
+        first = len;
+    memcpy(buf, (const uint8_t *)rx_buffer + at, first);
+    memcpy(buf + first, (const uint8_t *)rx_buffer, len - first);
+    
+    rx_tail = tail + len;
+    rx_taken();
+    return len;
+}
+
+// Whether there's anything in the RX buffer
+uint8_t serial_available()
+{
+    return rx_head != rx_tail;
+}
+
+// Wait for everything queued to go out, including the last byte, which may
+// still be in the shift register once the queue's empty
+void serial_flush()
+{
+    while (!tx_idle)
+        ;
+    
+    // 10 bits of 8 * (UBRR + 1) cycles each; 4 cycles per loop
+    uint16_t ubrr = (UBRR0H << 8) | UBRR0L;
+    uint8_t bit;
+    for (bit = 0; bit < 10; bit++)
+        _delay_loop_2(2 * (ubrr + 1));
+}
+
+// Switch baud rate once the reply to the command asking for it has gone out.
+// The baud rate has to have been checked with serial_ubrr().
+void serial_set_baud(uint32_t baud)
+{
+    serial_flush();
     cli();
-	if (rx_len == 0)
-	    data = -1;
-    else
-    {	    
-	    data = rx_buffer[rx_ptr++];
-	    rx_ptr %= RXBUFFER;
-	    rx_len--;
-	}
-	sei();
-	return data;
+    set_ubrr(serial_ubrr(baud));
+    sei();
 }
 
-unsigned char serial_receive()
+// Change flow control mode. The sender is free to send from here on.
+void serial_set_flow(uint8_t mode)
 {
-    int16_t data = serial_receive_nowait();
-    while (data < 0)
+    cli();
+    
+    // Let it go again the old way, if it's been stopped
+    if (rx_stopped)
+        flow(0);
+    
+    if (mode == FLOW_RTSCTS)
     {
-        data = serial_receive_nowait();
+        RTS_PORT &= ~_BV(RTS_BIT);
+        RTS_DDR |= _BV(RTS_BIT);
     }
-    return data;
+    else if (flow_mode == FLOW_RTSCTS)
+        RTS_DDR &= ~_BV(RTS_BIT);
+    flow_mode = mode;
+    sei();
+}
+
+// Copy the counters. The 16-bit ones could change halfway through.
+void serial_get_stats(struct serial_stats *copy)
+{
+    cli();
+    *copy = stats;
+    sei();
+}
+
+unsigned char serial_receive()
+{
+    while (!serial_available())
+        ;
+    return serial_receive_nowait();
 }
 
 ISR(USART_RX_vect)
 {
+    // The overrun flag is only good until the data is read
+    uint8_t status = UCSR0A;
+    
     // Receive the data (clears the interrupt bit)
     uint8_t data = UDR0;
     
+    if (status & _BV(DOR0))
+        stats.rx_overruns++;
+    
     // Ignore data that won't fit into the buffer
-    if (rx_len == RXBUFFER)
+    uint8_t len = rx_head - rx_tail;
+    if (len == RXBUFFER)
+    {
+        stats.rx_dropped++;
         return;
+    }
     
     // Otherwise dump it in the buffer
-    rx_buffer[(rx_ptr + rx_len++) % RXBUFFER] = data;
+    rx_buffer[rx_head & RX_MASK] = data;
+    rx_head++;
+    if (++len > stats.rx_high)
+        stats.rx_high = len;
+    
+    // Filling up: hold the sender off
+    if (len >= RX_STOP && !rx_stopped && flow_mode != FLOW_NONE)
+        flow(1);
 }
 
 ISR(USART_UDRE_vect)
 {
+    // XON and XOFF jump the queue
+    if (tx_flow)
+    {
+        UDR0 = tx_flow;
+        tx_flow = 0;
+        return;
+    }
+    
     // End of data?
-    if (tx_len == 0)
+    uint8_t tail = tx_tail;
+    if (tx_head == tail)
     {
         tx_idle = 1;
         // Must disable the interrupt here or else it'll be
@@ -136,8 +294,7 @@ ISR(USART_UDRE_vect)
     }
     
     // Load up the next character from the buffer
-    UDR0 = tx_buffer[tx_ptr++];
-    tx_ptr %= TXBUFFER;
-    tx_len--;
+    UDR0 = tx_buffer[tail & TX_MASK];
+    tx_tail = tail + 1;
 }
 
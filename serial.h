@@ -3,18 +3,67 @@
 
 #include <stdint.h>
 
+// Buffer sizes can be set from the Makefile. Each has to be a power of two
+// no bigger than 128, so that the 8-bit head and tail can run freely and the
+// difference between them is always how many bytes are waiting.
+#ifndef RXBUFFER
 #define RXBUFFER 64
+#endif
+#ifndef TXBUFFER
 #define TXBUFFER 16
+#endif
+
+#if RXBUFFER & (RXBUFFER - 1) || RXBUFFER > 128
+#error RXBUFFER has to be a power of two, up to 128
+#endif
+#if TXBUFFER & (TXBUFFER - 1) || TXBUFFER > 128
+#error TXBUFFER has to be a power of two, up to 128
+#endif
 
+// Baud rate at power-on; the sender can switch to another one
 #define FBAUD 57600
 
+// Flow control: the sender is told to stop once the RX buffer is RX_STOP
+// full, and to carry on once it's back down to RX_GO. That leaves room for
+// whatever's already on its way.
+#define FLOW_NONE 0
+#define FLOW_XONXOFF 1
+#define FLOW_RTSCTS 2
+
+#define RX_STOP (RXBUFFER / 2)
+#define RX_GO (RXBUFFER / 4)
+
+#define XON 0x11
+#define XOFF 0x13
+
+// RTS (active low, to the sender's CTS) is Digital 13 (PB5), the spindle
+// direction pin on a grbl board, which isn't used in laser mode
+#define RTS_PORT PORTB
+#define RTS_DDR DDRB
+#define RTS_BIT PORTB5
+
 extern volatile uint8_t rx_buffer[RXBUFFER];
 extern volatile uint8_t tx_buffer[TXBUFFER];
 
+// Counted since power-on
+struct serial_stats {
+    uint16_t rx_overruns;   // lost by the UART: the RX interrupt was held off too long
+    uint16_t rx_dropped;    // arrived with the RX buffer full
+    uint8_t rx_high;        // most bytes ever waiting in the RX buffer
+    uint8_t tx_high;        // and in the TX buffer
+};
+
 void serial_init();
 void serial_sendchar(unsigned char data);
 void serial_send(char *s);
 unsigned char serial_receive();
 int16_t serial_receive_nowait();
+uint8_t serial_receive_block(uint8_t *buf, uint8_t size);
+uint8_t serial_available();
+int16_t serial_ubrr(uint32_t baud);
+void serial_flush();
+void serial_set_baud(uint32_t baud);
+void serial_set_flow(uint8_t mode);
+void serial_get_stats(struct serial_stats *stats);
 
 #endif
@@ -0,0 +1,11 @@
+#ifndef __SIM_AVR_INTERRUPT_H
+#define __SIM_AVR_INTERRUPT_H
+
+#include "../sim.h"
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+#define cli() sim_cli()
+#define sei() sim_sei()
+
+#endif
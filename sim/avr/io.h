@@ -0,0 +1,119 @@
+#ifndef __SIM_AVR_IO_H
+#define __SIM_AVR_IO_H
+
+#include <stdint.h>
+#include "../sim.h"
+
+#define _BV(bit) (1 << (bit))
+
+#define PORTB sim_reg.portb
+#define DDRB sim_reg.ddrb
+#define PINB sim_reg.pinb
+#define PORTD sim_reg.portd
+#define DDRD sim_reg.ddrd
+#define PIND sim_reg.pind
+
+#define TCCR0A sim_reg.tccr0a
+#define TCCR0B sim_reg.tccr0b
+#define TIMSK0 sim_reg.timsk0
+#define OCR0A sim_reg.ocr0a
+#define OCR0B sim_reg.ocr0b
+#define TCNT0 (*sim_tcnt0())
+
+#define TCCR1A sim_reg.tccr1a
+#define TCCR1B sim_reg.tccr1b
+#define TIMSK1 sim_reg.timsk1
+#define TIFR1 sim_reg.tifr1
+#define OCR1A sim_reg.ocr1a
+#define OCR1B sim_reg.ocr1b
+#define TCNT1 (*sim_tcnt1())
+
+#define TCCR2A sim_reg.tccr2a
+#define TCCR2B sim_reg.tccr2b
+#define TIMSK2 sim_reg.timsk2
+#define TIFR2 sim_reg.tifr2
+#define OCR2A sim_reg.ocr2a
+#define OCR2B sim_reg.ocr2b
+#define TCNT2 sim_reg.tcnt2
+
+#define UBRR0H sim_reg.ubrr0h
+#define UBRR0L sim_reg.ubrr0l
+#define UCSR0A sim_reg.ucsr0a
+#define UCSR0B sim_reg.ucsr0b
+#define UCSR0C sim_reg.ucsr0c
+#define UDR0 (*sim_udr0())
+
+#define SREG sim_reg.sreg
+#define SMCR sim_reg.smcr
+
+// Port bits
+#define PORTB0 0
+#define PORTB1 1
+#define PORTB2 2
+#define PORTB3 3
+#define PORTB4 4
+#define PORTB5 5
+#define PORTD0 0
+#define PORTD1 1
+#define PORTD2 2
+#define PORTD3 3
+#define PORTD4 4
+#define PORTD5 5
+#define PORTD6 6
+#define PORTD7 7
+#define PINB1 1
+#define PINB2 2
+#define PIND4 4
+#define PIND7 7
+
+// Timer/counter 0
+#define WGM00 0
+#define WGM01 1
+#define COM0A0 6
+#define COM0A1 7
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define OCIE0A 1
+#define OCIE0B 2
+
+// Timer/counter 1
+#define WGM10 0
+#define WGM11 1
+#define WGM12 3
+#define WGM13 4
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define OCIE1A 1
+#define OCIE1B 2
+#define OCF1A 1
+#define OCF1B 2
+
+// Timer/counter 2
+#define WGM20 0
+#define WGM21 1
+#define COM2A0 6
+#define COM2A1 7
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define TOIE2 0
+#define TOV2 0
+#define OCIE2A 1
+
+// USART 0
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define DOR0 3
+#define U2X0 1
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ00 1
+#define UCSZ01 2
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __SIM_AVR_SLEEP_H
+#define __SIM_AVR_SLEEP_H
+
+#include "../sim.h"
+
+#define SLEEP_MODE_IDLE 0
+
+#define set_sleep_mode(mode) do { SMCR = (mode); } while (0)
+#define sleep_enable() do { SMCR |= 1; } while (0)
+#define sleep_disable() do { SMCR &= ~1; } while (0)
+#define sleep_cpu() sim_sleep()
+#define sleep_mode() do { sleep_enable(); sleep_cpu(); sleep_disable(); } while (0)
+
+#endif
@@ -0,0 +1,1443 @@
+// Host simulator for the rasterduino firmware.
+//
+// The firmware sources are compiled natively against the register shim in
+// this directory. Main-context code runs at host speed; interrupts are
+// delivered in virtual time (ATmega328p clock cycles) from a periodic
+// signal and from the blocking hooks (sleep_cpu(), _delay_loop_2(), sei()).
+// Each ISR is charged to virtual time as an estimated number of AVR cycles,
+// counted from the basic blocks, calls and memory accesses it went through
+// (or, with -k, timed on the host), so interrupt latency and missed step
+// deadlines show up the same way they would on the board.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/time.h>
+
+#include "sim.h"
+
+#define SIM_F_CPU 16000000ULL
+#define NEVER UINT64_MAX
+
+// Cycles for interrupt response, prologue/epilogue and reti
+#define ISR_OVERHEAD 20
+
+// What the rest of an ISR is charged: for each basic block (its arithmetic
+// and the branch out of it), each call and return, and each byte loaded
+// (including something done with it) or stored
+#define BLOCK_CYCLES 3
+#define CALL_CYCLES 8
+#define LOAD_CYCLES 3
+#define STORE_CYCLES 2
+
+int firmware_main(void);
+
+volatile struct sim_regs sim_reg;
+
+// Interrupt vectors in priority order (lowest vector number first)
+enum {
+    V_TIMER2_COMPA,
+    V_TIMER2_OVF,
+    V_TIMER1_COMPA,
+    V_TIMER1_COMPB,
+    V_TIMER0_COMPA,
+    V_TIMER0_COMPB,
+    V_USART_RX,
+    V_USART_UDRE,
+    V_COUNT
+};
+
+void TIMER2_COMPA_vect(void) __attribute__((weak));
+void TIMER2_OVF_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void TIMER1_COMPB_vect(void) __attribute__((weak));
+void TIMER0_COMPA_vect(void) __attribute__((weak));
+void TIMER0_COMPB_vect(void) __attribute__((weak));
+void USART_RX_vect(void) __attribute__((weak));
+void USART_UDRE_vect(void) __attribute__((weak));
+
+static struct vector {
+    const char *name;
+    void (*fn)(void);
+    int pending;
+    uint64_t raised;
+    uint64_t deadline;
+
+    uint64_t count;
+    uint64_t cycles_total;
+    uint32_t cycles_min, cycles_max;
+    uint64_t latency_max;
+    uint64_t lost;
+    uint64_t late;
+    uint64_t clipped;
+    double cycles_avg;
+} vectors[V_COUNT];
+
+struct timer {
+    const char *name;
+    int bits;
+    int vec_a, vec_b;
+
+    int on;
+    unsigned ps;
+    uint64_t origin;
+    int a_wrap, b_done;
+    uint16_t shadow, ocra, ocrb;
+};
+
+static struct timer timers[2] = {
+    { "timer0", 8, V_TIMER0_COMPA, V_TIMER0_COMPB },
+    { "timer1", 16, V_TIMER1_COMPA, V_TIMER1_COMPB },
+};
+
+static uint64_t vtime;
+static double clock_overhead_ns;
+static volatile sig_atomic_t in_sim;
+static double cycles_per_ns;
+static unsigned quantum_us = 20;
+static uint64_t cycle_limit = NEVER;
+static double idle_seconds = 5.0;
+static uint64_t last_activity;
+static uint64_t idle_ahead;    // real time waited past the clock's tick
+static int real_time;
+static struct timespec real_start;
+
+// Serial link
+static int in_fd = -1, out_fd = -1, pty_mode;
+
+// First and last step, X or Y
+static uint64_t first_step, last_step;
+
+// First and last step that burnt anything, and the lines burnt
+static uint64_t first_lit, last_lit, lit_lines;
+static int32_t lit_y;
+static int in_eof;
+static uint8_t in_buf[4096];
+static int in_len, in_pos;
+static int rx_inflight;
+static uint8_t rx_byte;
+static uint64_t rx_done, rx_line_free;
+// Received bytes not yet read: the two-byte receive buffer plus one
+// waiting in the shift register. Only a fourth one is an overrun.
+#define RX_FIFO 3
+static uint8_t rx_fifo[RX_FIFO];
+static int rx_unread;
+static uint64_t rx_bytes, rx_overruns;
+static int tx_busy, tx_full;
+static uint8_t tx_shift, tx_hold;
+static uint64_t tx_done;
+static uint64_t tx_bytes;
+
+// Flow control: the sender's end stops starting new bytes once it's seen an
+// XOFF go out, or while RTS (PB5) is high, as a USB-serial adapter would
+static int rx_xoff;
+static uint64_t rx_holds;
+
+// USB-serial latency each way: input that turns up after a gap can't start
+// arriving until this long after, and output takes this long to get out
+static uint64_t latency;
+static uint64_t in_ready;
+static int in_starved = 1;
+#define OUT_QUEUE 4096
+static uint8_t out_queue[OUT_QUEUE];
+static uint64_t out_due[OUT_QUEUE];
+static int out_head, out_tail;
+
+// Line noise: one bit flipped in about one in this many bytes each way
+static int rx_noise, tx_noise;
+static uint64_t rx_damaged, tx_damaged;
+
+static uint8_t noise(uint8_t byte, int one_in, uint64_t *damaged)
+{
+    if (one_in && rand() % one_in == 0)
+    {
+        (*damaged)++;
+        return byte ^ (1 << (rand() % 8));
+    }
+    return byte;
+}
+
+// Motion
+static uint8_t last_portb, last_portd, last_power, last_armed;
+static int32_t xpos, ypos, xmin, xmax, ymin, ymax;
+static uint64_t xsteps, ysteps, disabled_steps;
+static FILE *trace;
+
+// Burn map: one row per Y position that saw the laser armed
+struct burn_row {
+    int32_t y;
+    int32_t x0, x1;
+    uint8_t *power;
+};
+static struct burn_row *rows;
+static int nrows, rows_alloc;
+static const char *burn_file;
+
+static uint64_t ns_to_cycles(double ns)
+{
+    return (uint64_t)(ns * SIM_F_CPU / 1e9);
+}
+
+static double cycles_to_seconds(uint64_t cycles)
+{
+    return (double)cycles / SIM_F_CPU;
+}
+
+static uint64_t byte_cycles()
+{
+    uint32_t ubrr = ((uint32_t)sim_reg.ubrr0h << 8) | sim_reg.ubrr0l;
+    uint32_t div = (sim_reg.ucsr0a & (1 << 1)) ? 8 : 16;
+    return 10ULL * div * (ubrr + 1);
+}
+
+// Serial input source
+
+// Returns next byte, -1 if none available yet, -2 at end of input
+static int source_peek()
+{
+    if (in_pos < in_len)
+        return in_buf[in_pos];
+    if (in_eof || in_fd < 0)
+        return -2;
+
+    ssize_t got = read(in_fd, in_buf, sizeof(in_buf));
+    if (got > 0)
+    {
+        in_len = got;
+        in_pos = 0;
+        if (in_starved)
+            in_ready = vtime + latency;
+        in_starved = 0;
+        return in_buf[0];
+    }
+    in_starved = 1;
+    if (got == 0 && !pty_mode)
+        in_eof = 1;
+    if (got < 0 && errno != EAGAIN && errno != EINTR && !pty_mode)
+        in_eof = 1;
+    return in_eof ? -2 : -1;
+}
+
+// Wait up to timeout_us of real time for input to arrive
+static void source_wait(unsigned timeout_us)
+{
+    if (in_fd < 0 || in_eof || in_pos < in_len)
+        return;
+    struct pollfd pfd = { in_fd, POLLIN, 0 };
+    struct timespec timeout = { timeout_us / 1000000, timeout_us % 1000000 * 1000 };
+    ppoll(&pfd, 1, &timeout, NULL);
+}
+
+static void sink_write(uint8_t byte)
+{
+    tx_bytes++;
+    if (latency)
+    {
+        out_queue[out_head] = byte;
+        out_due[out_head] = vtime + latency;
+        out_head = (out_head + 1) % OUT_QUEUE;
+        return;
+    }
+    if (out_fd >= 0)
+    {
+        while (write(out_fd, &byte, 1) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+// Hand on output whose latency is up
+static void sink_flush()
+{
+    while (out_tail != out_head && out_due[out_tail] <= vtime)
+    {
+        if (out_fd >= 0)
+        {
+            while (write(out_fd, &out_queue[out_tail], 1) < 0 && errno == EINTR)
+                ;
+        }
+        out_tail = (out_tail + 1) % OUT_QUEUE;
+    }
+}
+
+// Motion and laser observation
+
+static uint8_t laser_power()
+{
+    if ((sim_reg.tccr2a & (1 << 7)) && (sim_reg.tccr2b & 7))
+        return sim_reg.ocr2a;
+    if ((sim_reg.ddrb & (1 << 3)) && (sim_reg.portb & (1 << 3)))
+        return 255;
+    return 0;
+}
+
+static int laser_armed()
+{
+    return (sim_reg.tccr2a & (1 << 7)) != 0;
+}
+
+static struct burn_row *burn_row(int32_t y)
+{
+    int i;
+    for (i = nrows - 1; i >= 0; i--)
+    {
+        if (rows[i].y == y)
+            return &rows[i];
+    }
+    if (nrows == rows_alloc)
+    {
+        rows_alloc = rows_alloc ? rows_alloc * 2 : 64;
+        rows = realloc(rows, rows_alloc * sizeof(*rows));
+    }
+    rows[nrows].y = y;
+    rows[nrows].x0 = 0;
+    rows[nrows].x1 = 0;
+    rows[nrows].power = NULL;
+    return &rows[nrows++];
+}
+
+static void burn(int32_t x, int32_t y, uint8_t power)
+{
+    struct burn_row *row = burn_row(y);
+    if (row->power == NULL)
+    {
+        row->x0 = x;
+        row->x1 = x + 1;
+        row->power = calloc(1, 1);
+    }
+    else if (x < row->x0 || x >= row->x1)
+    {
+        int32_t x0 = x < row->x0 ? x : row->x0;
+        int32_t x1 = x >= row->x1 ? x + 1 : row->x1;
+        uint8_t *p = calloc(x1 - x0, 1);
+        memcpy(p + (row->x0 - x0), row->power, row->x1 - row->x0);
+        free(row->power);
+        row->power = p;
+        row->x0 = x0;
+        row->x1 = x1;
+    }
+    if (power > row->power[x - row->x0])
+        row->power[x - row->x0] = power;
+}
+
+// Trace records, one a line, each starting with the cycle:
+//     X <x> <power>    an X step, and the power the cell it crossed got
+//     Y <y>            a Y step
+//     XD <dir>, YD <dir>   the direction pin changed: 1 or -1
+//     P <power>        the laser's power changed
+static void watch_ports()
+{
+    uint8_t portd = sim_reg.portd;
+    uint8_t rising = portd & ~last_portd;
+    uint8_t changed = portd ^ last_portd;
+
+    if (trace && (changed & (1 << 5)))
+        fprintf(trace, "%llu XD %d\n", (unsigned long long)vtime,
+            (portd & (1 << 5)) ? 1 : -1);
+    if (trace && (changed & (1 << 6)))
+        fprintf(trace, "%llu YD %d\n", (unsigned long long)vtime,
+            (portd & (1 << 6)) ? 1 : -1);
+
+    if (rising & (1 << 2))
+    {
+        // The cell just crossed was burnt at whatever power was set
+        // before this step; the ISR making the step may already have
+        // changed it for the next one.
+        int dir = (portd & (1 << 5)) ? 1 : -1;
+        uint8_t power = last_power;
+        if (last_armed)
+            burn(dir > 0 ? xpos : xpos - 1, ypos, power);
+        if (last_armed && power)
+        {
+            if (!lit_lines || ypos != lit_y)
+                lit_lines++;
+            lit_y = ypos;
+            if (!first_lit)
+                first_lit = vtime;
+            last_lit = vtime;
+        }
+        xpos += dir;
+        xsteps++;
+        if (xpos < xmin) xmin = xpos;
+        if (xpos > xmax) xmax = xpos;
+        if (sim_reg.portb & 1)
+            disabled_steps++;
+        if (trace)
+            fprintf(trace, "%llu X %d %u\n", (unsigned long long)vtime,
+                xpos, power);
+        last_activity = vtime;
+        if (!first_step)
+            first_step = vtime;
+        last_step = vtime;
+    }
+    if (rising & (1 << 3))
+    {
+        ypos += (portd & (1 << 6)) ? 1 : -1;
+        ysteps++;
+        if (ypos < ymin) ymin = ypos;
+        if (ypos > ymax) ymax = ypos;
+        if (sim_reg.portb & 1)
+            disabled_steps++;
+        if (trace)
+            fprintf(trace, "%llu Y %d\n", (unsigned long long)vtime, ypos);
+        last_activity = vtime;
+        if (!first_step)
+            first_step = vtime;
+        last_step = vtime;
+    }
+    last_portd = portd;
+    if ((sim_reg.ddrb & (1 << 5)) && (sim_reg.portb & ~last_portb & (1 << 5)))
+        rx_holds++;
+    last_portb = sim_reg.portb;
+    uint8_t power = laser_power();
+    if (trace && power != last_power)
+        fprintf(trace, "%llu P %u\n", (unsigned long long)vtime, power);
+    last_power = power;
+    last_armed = laser_armed();
+}
+
+// Timers
+
+static uint8_t timer_cs(struct timer *t)
+{
+    return t->bits == 8 ? sim_reg.tccr0b & 7 : sim_reg.tccr1b & 7;
+}
+
+static int timer_ctc(struct timer *t)
+{
+    return t->bits == 8 ? (sim_reg.tccr0a & (1 << 1)) != 0
+        : (sim_reg.tccr1b & (1 << 3)) != 0;
+}
+
+static uint16_t timer_ocra(struct timer *t)
+{
+    return t->bits == 8 ? sim_reg.ocr0a : sim_reg.ocr1a;
+}
+
+static uint16_t timer_ocrb(struct timer *t)
+{
+    return t->bits == 8 ? sim_reg.ocr0b : sim_reg.ocr1b;
+}
+
+static uint8_t timer_timsk(struct timer *t)
+{
+    return t->bits == 8 ? sim_reg.timsk0 : sim_reg.timsk1;
+}
+
+static volatile uint16_t *timer_tcnt(struct timer *t)
+{
+    // The 8-bit counter is widened through a shadow on read
+    static uint16_t tcnt0_wide;
+    if (t->bits == 8)
+    {
+        tcnt0_wide = sim_reg.tcnt0;
+        return &tcnt0_wide;
+    }
+    return &sim_reg.tcnt1;
+}
+
+static void timer_store(struct timer *t, uint16_t count)
+{
+    if (t->bits == 8)
+        sim_reg.tcnt0 = count;
+    else
+        sim_reg.tcnt1 = count;
+    t->shadow = count;
+}
+
+static unsigned prescale(uint8_t cs)
+{
+    static const unsigned table[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+    return table[cs];
+}
+
+// Counter value now, without wraparound
+static uint32_t timer_elapsed(struct timer *t)
+{
+    if (vtime < t->origin)
+        return 0;
+    return (vtime - t->origin) / t->ps;
+}
+
+static uint32_t timer_count(struct timer *t)
+{
+    if (!t->on)
+        return t->shadow;
+    uint32_t max = t->bits == 8 ? 0xff : 0xffff;
+    uint32_t count = timer_elapsed(t);
+    return count > max ? max : count;
+}
+
+static void timer_sync(struct timer *t)
+{
+    uint8_t cs = timer_cs(t);
+    uint16_t reg = *timer_tcnt(t);
+
+    if (t->on && cs == 0)
+    {
+        timer_store(t, timer_count(t));
+        t->on = 0;
+        return;
+    }
+    if (!t->on && cs != 0)
+    {
+        t->on = 1;
+        t->ps = prescale(cs);
+        t->origin = vtime - (uint64_t)reg * t->ps;
+        t->a_wrap = t->b_done = 0;
+        t->shadow = reg;
+        t->ocra = timer_ocra(t);
+        t->ocrb = timer_ocrb(t);
+        return;
+    }
+    if (!t->on)
+    {
+        t->shadow = reg;
+        return;
+    }
+    if (reg != t->shadow || prescale(cs) != t->ps)
+    {
+        // Counter written (or clock changed) while running
+        t->ps = prescale(cs);
+        t->origin = vtime - (uint64_t)reg * t->ps;
+        t->a_wrap = t->b_done = 0;
+        t->shadow = reg;
+    }
+
+    // A compare value moved below the counter is missed until wraparound
+    uint32_t count = timer_elapsed(t);
+    if (timer_ocra(t) != t->ocra)
+    {
+        t->ocra = timer_ocra(t);
+        if (t->ocra < count)
+            t->a_wrap = 1;
+    }
+    if (timer_ocrb(t) != t->ocrb)
+    {
+        t->ocrb = timer_ocrb(t);
+        if (t->ocrb < count)
+            t->b_done = 1;
+    }
+}
+
+static uint64_t timer_next_a(struct timer *t)
+{
+    uint32_t ocra = timer_ocra(t);
+    if (t->a_wrap)
+        ocra += t->bits == 8 ? 0x100 : 0x10000;
+    return t->origin + (uint64_t)ocra * t->ps;
+}
+
+static uint64_t timer_next_b(struct timer *t)
+{
+    if (t->vec_b < 0 || t->b_done)
+        return NEVER;
+    if (timer_ctc(t) && timer_ocrb(t) > timer_ocra(t))
+        return NEVER;
+    return t->origin + (uint64_t)timer_ocrb(t) * t->ps;
+}
+
+// Interrupt delivery
+
+static void raise_irq(int v, uint64_t deadline)
+{
+    if (vectors[v].pending)
+    {
+        vectors[v].lost++;
+        return;
+    }
+    vectors[v].pending = 1;
+    vectors[v].raised = vtime;
+    vectors[v].deadline = deadline;
+}
+
+static void timer_fire(struct timer *t, uint64_t now)
+{
+    if (!t->on)
+        return;
+
+    uint64_t b = timer_next_b(t);
+    if (b <= now)
+    {
+        t->b_done = 1;
+        if (timer_timsk(t) & (1 << 2))
+            raise_irq(t->vec_b, b + (uint64_t)(timer_ocra(t) + 1) * t->ps);
+    }
+
+    uint64_t a = timer_next_a(t);
+    if (a <= now)
+    {
+        uint64_t period = (uint64_t)(timer_ocra(t) + 1) * t->ps;
+        // Only clear-timer-on-compare mode is modelled
+        t->origin = a + t->ps;
+        t->a_wrap = 0;
+        t->b_done = 0;
+        if (timer_timsk(t) & (1 << 1))
+            raise_irq(t->vec_a, a + period);
+    }
+}
+
+// Timer2 only runs the laser's PWM, which is watched through OCR2A, and
+// overflows, which are all that's modelled of it
+static uint64_t t2_overflow;
+static unsigned t2_ps;
+
+static void timer2_sync()
+{
+    static const unsigned table[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+    unsigned ps = table[sim_reg.tccr2b & 7];
+    if (ps && !t2_ps)
+        t2_overflow = vtime + (uint64_t)(256 - sim_reg.tcnt2) * ps;
+    t2_ps = ps;
+}
+
+static uint64_t timer2_next()
+{
+    return t2_ps && (sim_reg.timsk2 & 1) ? t2_overflow : NEVER;
+}
+
+static void timer2_fire()
+{
+    if (!t2_ps || t2_overflow > vtime)
+        return;
+    uint64_t period = 256ULL * t2_ps;
+    t2_overflow += (vtime - t2_overflow) / period * period + period;
+    if (sim_reg.timsk2 & 1)
+        raise_irq(V_TIMER2_OVF, t2_overflow);
+}
+
+static void sim_sync()
+{
+    int i;
+
+    // Transmit register written?
+    if (!(sim_reg.udr0 & 0x100))
+    {
+        uint8_t byte = sim_reg.udr0;
+        sim_reg.udr0 = 0x100 | rx_fifo[0];
+        if (!tx_busy)
+        {
+            tx_busy = 1;
+            tx_shift = byte;
+            tx_done = vtime + byte_cycles();
+        }
+        else
+        {
+            tx_full = 1;
+            tx_hold = byte;
+        }
+    }
+    if (tx_full)
+        sim_reg.ucsr0a &= ~(1 << 5);
+    else
+        sim_reg.ucsr0a |= (1 << 5);
+
+    for (i = 0; i < 2; i++)
+        timer_sync(&timers[i]);
+    timer2_sync();
+
+    watch_ports();
+
+    // Data register empty is level-triggered
+    if ((sim_reg.ucsr0b & (1 << 5)) && !tx_full && !vectors[V_USART_UDRE].pending)
+        raise_irq(V_USART_UDRE, NEVER);
+}
+
+static uint64_t next_event()
+{
+    uint64_t next = NEVER;
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        struct timer *t = &timers[i];
+        if (!t->on)
+            continue;
+        uint64_t a = timer_next_a(t), b = timer_next_b(t);
+        if (a < next) next = a;
+        if (b < next) next = b;
+    }
+    if (tx_busy && tx_done < next)
+        next = tx_done;
+
+    int held = rx_xoff || ((sim_reg.ddrb & (1 << 5)) && (sim_reg.portb & (1 << 5)));
+    if (!rx_inflight && (sim_reg.ucsr0b & (1 << 4)) && !held)
+    {
+        int c = source_peek();
+        if (c >= 0)
+        {
+            in_pos++;
+            rx_inflight = 1;
+            rx_byte = c;
+            uint64_t start = vtime > rx_line_free ? vtime : rx_line_free;
+            if (start < in_ready)
+                start = in_ready;
+            rx_done = start + byte_cycles();
+        }
+    }
+    if (rx_inflight && rx_done < next)
+        next = rx_done;
+    if (out_tail != out_head && out_due[out_tail] < next)
+        next = out_due[out_tail];
+
+    return next;
+}
+
+static void fire_events()
+{
+    int i;
+    for (i = 0; i < 2; i++)
+        timer_fire(&timers[i], vtime);
+    timer2_fire();
+    sink_flush();
+
+    if (tx_busy && tx_done <= vtime)
+    {
+        // Flow control is left alone: it's not what's being tested
+        if (tx_shift == 0x11 || tx_shift == 0x13)
+            sink_write(tx_shift);
+        else
+            sink_write(noise(tx_shift, tx_noise, &tx_damaged));
+        if (tx_shift == 0x13 && !rx_xoff)
+        {
+            rx_xoff = 1;
+            rx_holds++;
+        }
+        else if (tx_shift == 0x11)
+            rx_xoff = 0;
+        last_activity = vtime;
+        tx_busy = 0;
+        if (tx_full)
+        {
+            tx_full = 0;
+            tx_busy = 1;
+            tx_shift = tx_hold;
+            tx_done = vtime + byte_cycles();
+        }
+    }
+
+    if (rx_inflight && rx_done <= vtime)
+    {
+        rx_inflight = 0;
+        rx_line_free = rx_done;
+        rx_bytes++;
+        rx_byte = noise(rx_byte, rx_noise, &rx_damaged);
+        last_activity = vtime;
+        if (rx_unread == RX_FIFO)
+        {
+            // No room left for it
+            rx_overruns++;
+            sim_reg.ucsr0a |= (1 << 3);
+        }
+        else
+        {
+            rx_fifo[rx_unread++] = rx_byte;
+            if (rx_unread == 1)
+            {
+                sim_reg.udr0 = 0x100 | rx_byte;
+                sim_reg.ucsr0a |= (1 << 7);
+                if (sim_reg.ucsr0b & (1 << 7))
+                    raise_irq(V_USART_RX, NEVER);
+            }
+        }
+    }
+}
+
+static void sim_sync();
+static uint64_t next_event();
+static void fire_events();
+static double idle_wait(unsigned real_us);
+
+// The ISR running, if any, the cycles it's been charged so far, how deep in
+// calls it is; and with -k, when it started on the host and the host time
+// it's spent in hooks that aren't part of it
+static int isr_vector = -1;
+static uint32_t isr_cycles;
+static int isr_depth;
+static struct timespec isr_start;
+static double isr_hooks_ns;
+
+// The firmware is built with the compiler's thread sanitizer and coverage
+// instrumentation, which call these for every basic block, function and
+// memory access; they count what the running ISR does. Eight-byte accesses
+// are the host's pointers, two bytes on the AVR.
+static inline void isr_charge(uint32_t cycles)
+{
+    if (isr_vector >= 0)
+        isr_cycles += cycles;
+}
+
+static inline uint32_t avr_bytes(uint32_t size)
+{
+    return size == 8 ? 2 : size;
+}
+
+void __tsan_init(void)
+{
+}
+
+void __sanitizer_cov_trace_pc(void)
+{
+    isr_charge(BLOCK_CYCLES);
+}
+
+void __tsan_func_entry(void *pc)
+{
+    // The ISR's own entry is in ISR_OVERHEAD
+    if (isr_vector >= 0 && isr_depth++)
+        isr_cycles += CALL_CYCLES;
+}
+
+void __tsan_func_exit(void)
+{
+    if (isr_vector >= 0)
+        isr_depth--;
+}
+
+#define ACCESS_HOOKS(size) \
+    void __tsan_read##size(void *p) { isr_charge(avr_bytes(size) * LOAD_CYCLES); } \
+    void __tsan_write##size(void *p) { isr_charge(avr_bytes(size) * STORE_CYCLES); } \
+    void __tsan_volatile_read##size(void *p) { isr_charge(avr_bytes(size) * LOAD_CYCLES); } \
+    void __tsan_volatile_write##size(void *p) { isr_charge(avr_bytes(size) * STORE_CYCLES); }
+
+ACCESS_HOOKS(1)
+ACCESS_HOOKS(2)
+ACCESS_HOOKS(4)
+ACCESS_HOOKS(8)
+
+void __tsan_read_range(void *p, unsigned long size)
+{
+    isr_charge(size * LOAD_CYCLES);
+}
+
+void __tsan_write_range(void *p, unsigned long size)
+{
+    isr_charge(size * STORE_CYCLES);
+}
+
+static double ns_since(const struct timespec *start, const struct timespec *now)
+{
+    return (now->tv_sec - start->tv_sec) * 1e9 + (now->tv_nsec - start->tv_nsec);
+}
+
+// Cycles the running ISR would have taken on the board by now
+static uint64_t isr_elapsed(const struct timespec *now)
+{
+    if (!cycles_per_ns)
+        return ISR_OVERHEAD / 2 + isr_cycles;
+
+    double ns = ns_since(&isr_start, now) - isr_hooks_ns - clock_overhead_ns;
+    if (ns < 0)
+        ns = 0;
+    uint64_t cycles = ISR_OVERHEAD / 2 + (uint64_t)(ns * cycles_per_ns);
+
+    // Clipped like the whole ISR's time is, below
+    uint64_t most = 3 * vectors[isr_vector].cycles_avg + ISR_OVERHEAD;
+    return cycles < most ? cycles : most;
+}
+
+static void dispatch(int v)
+{
+    struct vector *vec = &vectors[v];
+    struct timespec start, end;
+    uint64_t latency = vtime - vec->raised;
+
+    vec->pending = 0;
+    sim_reg.sreg &= ~0x80;
+
+    // Taking the interrupt clears its flag
+    if (v == V_TIMER1_COMPA)
+        sim_reg.tifr1 &= ~(1 << 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    isr_vector = v;
+    isr_cycles = 0;
+    isr_depth = 0;
+    isr_start = start;
+    isr_hooks_ns = 0;
+    if (vec->fn)
+        vec->fn();
+    isr_vector = -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    sim_reg.sreg |= 0x80;
+    if (v == V_USART_RX && rx_unread)
+    {
+        // The ISR read one; the next, if there is one, moves up
+        memmove(rx_fifo, rx_fifo + 1, --rx_unread);
+        sim_reg.ucsr0a &= ~(1 << 3);
+        if (rx_unread)
+        {
+            sim_reg.udr0 = 0x100 | rx_fifo[0];
+            if (sim_reg.ucsr0b & (1 << 7))
+                raise_irq(V_USART_RX, NEVER);
+        }
+        else
+            sim_reg.ucsr0a &= ~(1 << 7);
+    }
+
+    uint32_t cycles = ISR_OVERHEAD + isr_cycles;
+    if (cycles_per_ns)
+    {
+        double ns = ns_since(&start, &end) - isr_hooks_ns - clock_overhead_ns;
+        if (ns < 0)
+            ns = 0;
+        cycles = ISR_OVERHEAD + (uint32_t)(ns * cycles_per_ns);
+
+        // Host scheduling and page faults show up as huge one-off samples;
+        // clip anything far above this vector's running average.
+        if (cycles > 3 * vec->cycles_avg + ISR_OVERHEAD)
+        {
+            cycles = 3 * vec->cycles_avg + ISR_OVERHEAD;
+            vec->clipped++;
+        }
+        vec->cycles_avg += ((double)cycles - vec->cycles_avg) / 32;
+    }
+
+    vec->count++;
+    vec->cycles_total += cycles;
+    if (vec->count == 1 || cycles < vec->cycles_min)
+        vec->cycles_min = cycles;
+    if (cycles > vec->cycles_max)
+        vec->cycles_max = cycles;
+    if (latency > vec->latency_max)
+        vec->latency_max = latency;
+    if (vtime + cycles > vec->deadline)
+        vec->late++;
+
+    // Peripherals keep running while the ISR executes
+    sim_sync();
+    uint64_t end_time = vtime + cycles;
+    while (1)
+    {
+        uint64_t next = next_event();
+        if (next > end_time)
+            break;
+        if (next > vtime)
+            vtime = next;
+        fire_events();
+    }
+    vtime = end_time;
+}
+
+static int pending_vector()
+{
+    int v;
+    for (v = 0; v < V_COUNT; v++)
+    {
+        if (vectors[v].pending)
+            return v;
+    }
+    return -1;
+}
+
+static void sim_finish();
+
+// Cost of the timestamps themselves, subtracted from every ISR measurement
+static void calibrate_clock()
+{
+    int i;
+    clock_overhead_ns = 1e9;
+    for (i = 0; i < 10000; i++)
+    {
+        struct timespec a, b;
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        double ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+        if (ns < clock_overhead_ns)
+            clock_overhead_ns = ns;
+    }
+}
+
+// With -R, don't let virtual time get ahead of real time, so that the
+// sender's timing counts for as much as it would with a real controller
+static void pace(uint64_t to)
+{
+    if (!real_time)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ahead = to * 1e9 / SIM_F_CPU
+        - ((now.tv_sec - real_start.tv_sec) * 1e9 + (now.tv_nsec - real_start.tv_nsec));
+    if (ahead > 100000)
+    {
+        long long ns = (long long)ahead;
+        struct timespec wait = { ns / 1000000000, ns % 1000000000 };
+        nanosleep(&wait, NULL);
+    }
+}
+
+// Run virtual time forward to 'limit', delivering at most 'max_isrs'
+// interrupts. Returns the number delivered.
+static int sim_advance(uint64_t limit, int max_isrs)
+{
+    int delivered = 0;
+
+    while (1)
+    {
+        sim_sync();
+
+        if (sim_reg.sreg & 0x80)
+        {
+            int v = pending_vector();
+            if (v >= 0)
+            {
+                dispatch(v);
+                if (++delivered >= max_isrs)
+                {
+                    sim_sync();
+                    return delivered;
+                }
+                continue;
+            }
+        }
+
+        if (vtime >= cycle_limit)
+            sim_finish();
+
+        uint64_t next = next_event();
+        uint64_t tick = timer2_next();
+        if (tick < next && next == NEVER && limit == NEVER && vtime < tick)
+        {
+            // Only the clock's ticking: wait for input until it's due, so
+            // that virtual time keeps up with real time as when idle. The
+            // host may wait longer: that goes towards the waits after the
+            // tick rather than making it late.
+            uint64_t due = tick - vtime;
+            if (idle_ahead < due)
+                idle_ahead += ns_to_cycles(idle_wait((due - idle_ahead) * 1000000 / SIM_F_CPU + 1));
+            uint64_t waited = idle_ahead < due ? idle_ahead : due;
+            vtime += waited;
+            idle_ahead -= waited;
+            continue;
+        }
+        if (tick < next)
+            next = tick;
+        if (next > limit)
+        {
+            if (limit != NEVER && limit > vtime)
+                vtime = limit;
+            return delivered;
+        }
+        if (next == NEVER)
+            return delivered;
+        pace(next);
+        if (next > vtime)
+            vtime = next;
+        fire_events();
+    }
+}
+
+// Wait up to real_us of real time for input, unless it's been idle too
+// long. Returns the nanoseconds that passed.
+static double idle_wait(unsigned real_us)
+{
+    if (in_eof && vtime - last_activity > idle_seconds * SIM_F_CPU)
+        sim_finish();
+    if (pty_mode && vtime - last_activity > idle_seconds * SIM_F_CPU)
+        sim_finish();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    source_wait(real_us);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+// Nothing scheduled: let real time pass while waiting for input
+static void sim_idle(unsigned real_us)
+{
+    // The periodic signal cuts waits short: only count the time that passed
+    double ns = idle_wait(real_us);
+    if (ns > real_us * 1000.0)
+        ns = real_us * 1000.0;
+    vtime += ns_to_cycles(ns);
+}
+
+// Hooks called from the firmware
+
+void sim_cli(void)
+{
+    sim_reg.sreg &= ~0x80;
+}
+
+void sim_sei(void)
+{
+    sim_reg.sreg |= 0x80;
+    // The instruction after sei runs before any interrupt, so that
+    // "sleep_enable(); sei(); sleep_cpu();" can't miss a wakeup
+    if (sim_reg.smcr & 1)
+        return;
+    if (!in_sim && pending_vector() >= 0)
+    {
+        in_sim = 1;
+        sim_advance(vtime, 1000);
+        in_sim = 0;
+    }
+}
+
+uint8_t sim_atomic_enter(void)
+{
+    uint8_t sreg = sim_reg.sreg;
+    sim_cli();
+    return sreg;
+}
+
+void sim_atomic_leave(uint8_t sreg)
+{
+    if (sreg & 0x80)
+        sim_sei();
+}
+
+void sim_sleep(void)
+{
+    in_sim = 1;
+    while (sim_advance(NEVER, 1) == 0)
+        sim_idle(1000);
+    in_sim = 0;
+}
+
+void sim_delay_cycles(uint32_t cycles)
+{
+    in_sim = 1;
+    uint64_t until = vtime + cycles;
+    while (vtime < until)
+    {
+        if (in_pos >= in_len && !in_eof && pty_mode)
+            source_wait(cycles / (SIM_F_CPU / 1000000));
+        sim_advance(until, 1000000);
+    }
+    in_sim = 0;
+}
+
+volatile uint8_t *sim_tcnt0(void)
+{
+    int was = in_sim;
+    in_sim = 1;
+    timer_sync(&timers[0]);
+    timer_store(&timers[0], timer_count(&timers[0]));
+    in_sim = was;
+    return &sim_reg.tcnt0;
+}
+
+volatile uint16_t *sim_tcnt1(void)
+{
+    struct timer *t = &timers[1];
+    int was = in_sim;
+    in_sim = 1;
+
+    // Read from an ISR, the counter has moved on by as long as it's been
+    // running, and may have gone past the compare match and back to 0
+    struct timespec hook, done;
+    uint64_t now = vtime;
+    if (isr_vector >= 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &hook);
+        vtime += isr_elapsed(&hook);
+    }
+    timer_sync(t);
+    uint32_t count = timer_count(t);
+    if (isr_vector >= 0 && t->on)
+    {
+        count = timer_elapsed(t);
+        if (timer_ctc(t) && !t->a_wrap && count > timer_ocra(t))
+        {
+            count = (count - timer_ocra(t) - 1) % (timer_ocra(t) + 1);
+            sim_reg.tifr1 |= 1 << 1;
+        }
+        else if (count > 0xffff)
+            count = 0xffff;
+    }
+    timer_store(t, count);
+    vtime = now;
+    if (isr_vector >= 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &done);
+        isr_hooks_ns += ns_since(&hook, &done) + clock_overhead_ns;
+    }
+    in_sim = was;
+    return &sim_reg.tcnt1;
+}
+
+volatile uint16_t *sim_udr0(void)
+{
+    return &sim_reg.udr0;
+}
+
+// Periodic signal: main context has had its quantum, move to the next event
+static void tick(int sig)
+{
+    (void)sig;
+    if (in_sim || !(sim_reg.sreg & 0x80))
+        return;
+    in_sim = 1;
+    if (sim_advance(NEVER, 1) == 0)
+        sim_idle(quantum_us);
+    in_sim = 0;
+}
+
+// Reporting
+
+static void write_burn_map()
+{
+    int32_t x0 = INT32_MAX, x1 = INT32_MIN;
+    int32_t y0 = 0, y1 = INT32_MIN, y;
+    int i, j;
+
+    for (i = 0; i < nrows; i++)
+    {
+        if (!rows[i].power)
+            continue;
+        if (rows[i].x0 < x0) x0 = rows[i].x0;
+        if (rows[i].x1 > x1) x1 = rows[i].x1;
+        if (rows[i].y < y0) y0 = rows[i].y;
+        if (rows[i].y > y1) y1 = rows[i].y;
+    }
+    if (x1 <= x0)
+    {
+        fprintf(stderr, "sim: nothing was lasered, no burn map written\n");
+        return;
+    }
+
+    FILE *f = fopen(burn_file, "wb");
+    if (!f)
+    {
+        perror(burn_file);
+        return;
+    }
+
+    // One row per Y step from the starting position, so skipped lines
+    // and the scanline spacing show up as white rows. Likewise columns
+    // start from the starting position.
+    if (x0 > 0)
+        x0 = 0;
+    fprintf(f, "P5\n%d %d\n255\n", x1 - x0, y1 - y0 + 1);
+    for (y = y0; y <= y1; y++)
+    {
+        struct burn_row *row = NULL;
+        for (i = 0; i < nrows; i++)
+        {
+            if (rows[i].y == y && rows[i].power)
+                row = &rows[i];
+        }
+        for (j = x0; j < x1; j++)
+        {
+            uint8_t power = 0;
+            if (row && j >= row->x0 && j < row->x1)
+                power = row->power[j - row->x0];
+            // Rendered like the source image: more power is darker
+            fputc(255 - power, f);
+        }
+    }
+    fclose(f);
+    fprintf(stderr, "sim: burn map %dx%d written to %s\n", x1 - x0,
+        y1 - y0 + 1, burn_file);
+}
+
+static void sim_finish()
+{
+    int v;
+
+    fprintf(stderr, "\nsim: %llu cycles (%.3f s)\n",
+        (unsigned long long)vtime, cycles_to_seconds(vtime));
+    if (last_step)
+        fprintf(stderr, "sim: motion took %.3f s\n",
+            cycles_to_seconds(last_step - first_step));
+    if (lit_lines)
+        fprintf(stderr, "sim: lasering took %.3f s, first to last, over %llu lines "
+            "(%.1f ms each)\n", cycles_to_seconds(last_lit - first_lit),
+            (unsigned long long)lit_lines,
+            cycles_to_seconds(last_lit - first_lit) * 1000 / lit_lines);
+    fprintf(stderr, "sim: X %llu steps, range %d..%d, final %d\n",
+        (unsigned long long)xsteps, xmin, xmax, xpos);
+    fprintf(stderr, "sim: Y %llu steps, range %d..%d, final %d\n",
+        (unsigned long long)ysteps, ymin, ymax, ypos);
+    if (disabled_steps)
+        fprintf(stderr, "sim: %llu steps issued with drivers disabled\n",
+            (unsigned long long)disabled_steps);
+    fprintf(stderr, "sim: serial rx %llu bytes (%llu overruns, held off %llu times), tx %llu bytes\n",
+        (unsigned long long)rx_bytes, (unsigned long long)rx_overruns,
+        (unsigned long long)rx_holds, (unsigned long long)tx_bytes);
+    if (rx_noise || tx_noise)
+        fprintf(stderr, "sim: damaged %llu bytes received, %llu sent\n",
+            (unsigned long long)rx_damaged, (unsigned long long)tx_damaged);
+
+    fprintf(stderr, "sim: %-18s %9s %6s %6s %6s %8s %6s %6s\n", "vector",
+        "count", "min", "mean", "max", "latency", "late", "lost");
+    for (v = 0; v < V_COUNT; v++)
+    {
+        struct vector *vec = &vectors[v];
+        if (vec->count == 0)
+            continue;
+        fprintf(stderr, "sim: %-18s %9llu %6u %6llu %6u %8llu %6llu %6llu\n",
+            vec->name, (unsigned long long)vec->count, vec->cycles_min,
+            (unsigned long long)(vec->cycles_total / vec->count),
+            vec->cycles_max, (unsigned long long)vec->latency_max,
+            (unsigned long long)vec->late, (unsigned long long)vec->lost);
+    }
+
+    if (burn_file)
+        write_burn_map();
+    if (trace)
+        fclose(trace);
+    exit(vectors[V_TIMER1_COMPA].late || vectors[V_TIMER1_COMPA].lost ? 3 : 0);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [options]\n\n", name);
+    fprintf(stderr, "\t-p:\t\tCreate a pseudo-terminal for the sender to connect to\n");
+    fprintf(stderr, "\t-l path:\tSymlink the pseudo-terminal to path\n");
+    fprintf(stderr, "\t-i file:\tRead serial input from file (default stdin)\n");
+    fprintf(stderr, "\t-o file:\tWrite serial output to file (default stdout)\n");
+    fprintf(stderr, "\t-t file:\tWrite a step, direction and power trace to file\n");
+    fprintf(stderr, "\t-b file:\tWrite the burnt image as PGM to file\n");
+    fprintf(stderr, "\t-c cycles:\tStop after this many CPU cycles\n");
+    fprintf(stderr, "\t-T seconds:\tStop after this long without activity (default 5)\n");
+    fprintf(stderr, "\t-k factor:\tTime ISRs on the host, charging this many cycles per ns\n");
+    fprintf(stderr, "\t-q usec:\tReal time given to main context per event (default 20)\n");
+    fprintf(stderr, "\t-e n:\t\tDamage about one in n bytes received\n");
+    fprintf(stderr, "\t-E n:\t\tDamage about one in n bytes sent\n");
+    fprintf(stderr, "\t-L usec:\tUSB-serial latency each way\n");
+    fprintf(stderr, "\t-R:\t\tRun no faster than real time\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *link = NULL;
+    int c;
+
+    in_fd = 0;
+    out_fd = 1;
+    while ((c = getopt(argc, argv, "pl:i:o:t:b:c:T:k:q:e:E:L:R")) != -1)
+    {
+        switch (c)
+        {
+            case 'p':
+                pty_mode = 1;
+                break;
+            case 'l':
+                link = optarg;
+                break;
+            case 'i':
+                in_fd = strcmp(optarg, "-") ? open(optarg, O_RDONLY) : 0;
+                if (in_fd < 0)
+                {
+                    perror(optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                out_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (out_fd < 0)
+                {
+                    perror(optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                trace = fopen(optarg, "w");
+                break;
+            case 'b':
+                burn_file = optarg;
+                break;
+            case 'c':
+                cycle_limit = strtoull(optarg, NULL, 0);
+                break;
+            case 'T':
+                idle_seconds = atof(optarg);
+                break;
+            case 'k':
+                cycles_per_ns = atof(optarg);
+                break;
+            case 'q':
+                quantum_us = atoi(optarg);
+                break;
+            case 'e':
+                rx_noise = atoi(optarg);
+                break;
+            case 'E':
+                tx_noise = atoi(optarg);
+                break;
+            case 'L':
+                latency = ns_to_cycles(atof(optarg) * 1000);
+                break;
+            case 'R':
+                real_time = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (pty_mode)
+    {
+        int master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+        {
+            perror("pty");
+            exit(1);
+        }
+        // Hold the slave open so reads don't fail between sender runs
+        int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+        struct termios tio;
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        fprintf(stderr, "sim: serial port is %s\n", ptsname(master));
+        if (link)
+        {
+            unlink(link);
+            if (symlink(ptsname(master), link) < 0)
+                perror(link);
+        }
+        in_fd = out_fd = master;
+    }
+    if (in_fd >= 0 && (pty_mode || isatty(in_fd) || in_fd == 0))
+        fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+
+    vectors[V_TIMER2_COMPA] = (struct vector){ "TIMER2_COMPA_vect", TIMER2_COMPA_vect };
+    vectors[V_TIMER2_OVF] = (struct vector){ "TIMER2_OVF_vect", TIMER2_OVF_vect };
+    vectors[V_TIMER1_COMPA] = (struct vector){ "TIMER1_COMPA_vect", TIMER1_COMPA_vect };
+    vectors[V_TIMER1_COMPB] = (struct vector){ "TIMER1_COMPB_vect", TIMER1_COMPB_vect };
+    vectors[V_TIMER0_COMPA] = (struct vector){ "TIMER0_COMPA_vect", TIMER0_COMPA_vect };
+    vectors[V_TIMER0_COMPB] = (struct vector){ "TIMER0_COMPB_vect", TIMER0_COMPB_vect };
+    vectors[V_USART_RX] = (struct vector){ "USART_RX_vect", USART_RX_vect };
+    vectors[V_USART_UDRE] = (struct vector){ "USART_UDRE_vect", USART_UDRE_vect };
+
+    // Prime the running averages used to reject host noise
+    for (c = 0; c < V_COUNT; c++)
+        vectors[c].cycles_avg = 100;
+
+    // Power-on register state
+    sim_reg.udr0 = 0x100;
+    sim_reg.ucsr0a = 1 << 5;
+    sim_reg.portb = last_portb = 0;
+    sim_reg.portd = last_portd = 0;
+
+    calibrate_clock();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = tick;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &sa, NULL);
+
+    struct itimerval it;
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = quantum_us;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_REAL, &it, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &real_start);
+    firmware_main();
+    sim_finish();
+    return 0;
+}
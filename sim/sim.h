@@ -0,0 +1,40 @@
+#ifndef __SIM_H
+#define __SIM_H
+
+#include <stdint.h>
+
+// Register file of the simulated ATmega328p. Only the registers the
+// firmware actually touches are modelled.
+struct sim_regs {
+    uint8_t portb, ddrb, pinb;
+    uint8_t portd, ddrd, pind;
+
+    uint8_t tccr0a, tccr0b, timsk0, ocr0a, ocr0b, tcnt0;
+
+    uint8_t tccr1a, tccr1b, timsk1, tifr1;
+    uint16_t ocr1a, ocr1b, tcnt1;
+
+    uint8_t tccr2a, tccr2b, timsk2, tifr2, ocr2a, ocr2b, tcnt2;
+
+    uint8_t ubrr0h, ubrr0l, ucsr0a, ucsr0b, ucsr0c;
+
+    // Bit 8 set means "not written since the last look"
+    uint16_t udr0;
+
+    uint8_t sreg, smcr;
+};
+
+extern volatile struct sim_regs sim_reg;
+
+volatile uint8_t *sim_tcnt0(void);
+volatile uint16_t *sim_tcnt1(void);
+volatile uint16_t *sim_udr0(void);
+
+void sim_cli(void);
+void sim_sei(void);
+uint8_t sim_atomic_enter(void);
+void sim_atomic_leave(uint8_t sreg);
+void sim_sleep(void);
+void sim_delay_cycles(uint32_t cycles);
+
+#endif
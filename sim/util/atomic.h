@@ -0,0 +1,13 @@
+#ifndef __SIM_UTIL_ATOMIC_H
+#define __SIM_UTIL_ATOMIC_H
+
+#include "../sim.h"
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+
+#define ATOMIC_BLOCK(type) \
+    for (uint8_t __sreg = sim_atomic_enter(), __todo = 1; \
+        __todo; __todo = 0, sim_atomic_leave(__sreg))
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __SIM_UTIL_DELAY_BASIC_H
+#define __SIM_UTIL_DELAY_BASIC_H
+
+#include <stdint.h>
+#include "../sim.h"
+
+#define _delay_loop_1(count) sim_delay_cycles(3UL * (uint8_t)(count))
+#define _delay_loop_2(count) sim_delay_cycles(4UL * (uint16_t)(count))
+
+#endif
@@ -0,0 +1,50 @@
+#include "timer0.h"
+
+
+inline void timer0_init()
+{
+    // Set mode
+#if defined TIMER0_MODE0
+        // Not needing to be explicitly set as 0 is the default
+	//TCCR0A = 0; // Normal mode
+	//TCCR0B = 0; // Normal mode
+#elif defined TIMER0_MODE2
+        // Clear timer on compare (OCR0A)
+	TCCR0A = _BV(WGM01);
+	//TCCR0B = 0;
+#endif
+	// Enable selected interrupts
+	TIMSK0 |= 0
+#if defined TIMER0_ENABLE_INT_OCR0A
+                | _BV(OCIE0A)
+#endif
+#if defined TIMER0_ENABLE_INT_OCR0B
+                | _BV(OCIE0B)
+#endif
+                ;
+}
+
+inline void timer0_start()
+{
+	// Restart from 0
+	TCNT0 = 0;
+
+	/* Set prescaler to start timer */
+#if defined TIMER0_CLK_DIV_1
+	TCCR0B |= _BV(CS00); // No prescaling
+#elif defined TIMER0_CLK_DIV_8
+	TCCR0B |= _BV(CS01); // Clock/8
+#elif defined TIMER0_CLK_DIV_64
+	TCCR0B |= _BV(CS00) | _BV(CS01);
+#elif defined TIMER0_CLK_DIV_256
+	TCCR0B |= _BV(CS02);
+#elif defined TIMER0_CLK_DIV_1024
+	TCCR0B |= _BV(CS00) | _BV(CS02);
+#endif
+}
+
+inline void timer0_stop()
+{
+	/* Unset prescaler bits to stop timer */
+	TCCR0B &= ~(_BV(CS00) | _BV(CS01) | _BV(CS02));
+}
@@ -0,0 +1,24 @@
+#ifndef __TIMER0_H
+#define __TIMER0_H
+
+#include <avr/io.h>
+
+//#define TIMER0_MODE0
+#define TIMER0_MODE2 // Clear Timer on Compare OCR0A
+
+// Enable interrupts
+#define TIMER0_ENABLE_INT_OCR0A
+#define TIMER0_ENABLE_INT_OCR0B
+
+// Clock divider
+//#define TIMER0_CLK_DIV_1
+//#define TIMER0_CLK_DIV_8
+//#define TIMER0_CLK_DIV_64
+#define TIMER0_CLK_DIV_256
+//#define TIMER0_CLK_DIV_1024
+
+inline void timer0_init();
+inline void timer0_start();
+inline void timer0_stop();
+
+#endif
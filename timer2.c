@@ -23,6 +23,9 @@ inline void timer2_init()
 	TIMSK2 |= 0
 #if defined TIMER2_ENABLE_INT_OCR2
                 |_BV(OCIE2)
+#endif
+#if defined TIMER2_ENABLE_INT_OVF
+                | _BV(TOIE2)
 #endif
                 ;
 }
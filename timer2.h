@@ -8,6 +8,7 @@
 
 // Enable interrupts
 //#define TIMER2_ENABLE_INT_OCR2
+//#define TIMER2_ENABLE_INT_OVF
 
 // Clock divider
 //#define TIMER2_CLK_DIV_1